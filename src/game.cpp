@@ -1,15 +1,26 @@
+#ifdef GAME_SIM
+#include "sim.h"
+#else
 #include <alsa/asoundlib.h>
-#include <stdint.h>
-
 #include <bcm_host.h>
 
 #include "OMXReader.h"
-#include "omxplayer.h"
+#endif
 
-#define PACKET_HEADER 0xff
-#define PACKET_SIZE 3
+#include <math.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "omxplayer.h"
+#include "score.h"
+#include "metrics.h"
+#include "sfx.h"
+#include "protocol.h"
 
 #define UART_NAME "hw:1"
+#define UART_READ_SIZE		64
+#define UART_MAX_PFDS		4
 
 #define NUM_OVERLAYS		2
 #define OVERLAY_DISPLAY		0
@@ -24,6 +35,7 @@ typedef struct s_control_packet control_packet;
 struct s_control_packet {
     uint8_t instruction;
     uint8_t value;
+    int64_t time;
 
     control_packet *next;
 };
@@ -51,10 +63,18 @@ struct s_game_data {
     int pause_overlay;
 
     snd_rawmidi_t *output, *input;
+    struct pollfd uart_pfds[UART_MAX_PFDS];
+    int uart_num_pfds;
+    protocol_t protocol;
     uint8_t controller[NUM_CONTROLLERS];
-    uint8_t score[NUM_CONTROLLERS];
-    uint8_t cur_instruction;
+    score_config_t score_config;
+    score_stats_t scores[NUM_CONTROLLERS];
+    int scores_from_switch;
+    int power_sound[NUM_CONTROLLERS];
     control_packet *packet_list;
+    control_packet *packet_tail;
+    int packet_count;
+    int64_t stream_request;
 };
 
 static struct s_game_data game_data;
@@ -65,119 +85,283 @@ static struct s_game_data game_data;
 #define WINNER1_STREAM		3
 #define WINNER2_STREAM		4
 
-static void state_sleep(int update_state) {
+/* Allow packets timestamped before the cutoff to drain from the queue */
+#define SCORE_GRACE_US		50000
+/* Media times after this are still from before the seek to the start */
+#define SCORE_START_MAX_US	1000000
+
+/* With GAME_SIM all timing and thread switches go through the virtual
+ * clock and scheduler in sim.cpp */
+#ifdef GAME_SIM
+#define game_log sim_log
+#else
+#define game_log printf
+#endif
+
+static int64_t game_clock_us(void) {
+#ifdef GAME_SIM
+    return sim_clock_us();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static void game_sleep_us(int64_t us) {
+#ifdef GAME_SIM
+    sim_sleep_us(us);
+#else
+    usleep(us);
+#endif
+}
+
+static void start_thread(pthread_t *thread, void *(*func)(void *), void *arg) {
+#ifdef GAME_SIM
+    sim_thread_create(thread, func, arg);
+#else
+    pthread_create(thread, NULL, func, arg);
+#endif
+}
+
+/* Only one acquisition in LOCK_SAMPLE_PERIOD per thread is timed. On the
+ * Pi 1 each clock read may be a system call, see metrics_bench.cpp. */
+#define LOCK_SAMPLE_PERIOD	16
+
+static __thread unsigned int lock_count;
+static __thread int64_t lock_time;
+
+static void lock_game_data(void) {
+#ifdef GAME_SIM
+    sim_lock(&game_data.lock);
+#else
     pthread_mutex_lock(&game_data.lock);
+#endif
+    if (++lock_count % LOCK_SAMPLE_PERIOD) lock_time = 0;
+    else lock_time = game_clock_us();
+}
+
+static void unlock_game_data(void) {
+    if (lock_time)
+	metrics_observe(METRIC_LOCK_HOLD, game_clock_us() - lock_time);
+    pthread_mutex_unlock(&game_data.lock);
+}
+
+/* The lock isn't held while we wait, so don't count that time */
+static void wait_game_data(pthread_cond_t *cond) {
+    if (lock_time)
+	metrics_observe(METRIC_LOCK_HOLD, game_clock_us() - lock_time);
+#ifdef GAME_SIM
+    sim_wait(cond, &game_data.lock);
+#else
+    pthread_cond_wait(cond, &game_data.lock);
+#endif
+    if (lock_time) lock_time = game_clock_us();
+}
+
+static void wake_game_data(pthread_cond_t *cond, int all) {
+#ifdef GAME_SIM
+    sim_wake(cond, all);
+#else
+    if (all) pthread_cond_broadcast(cond);
+    else pthread_cond_signal(cond);
+#endif
+}
+
+static void state_sleep(int update_state) {
+    lock_game_data();
     while (!game_data.change_state)
-	pthread_cond_wait(&game_data.state_changed, &game_data.lock);
+	wait_game_data(&game_data.state_changed);
     if (update_state) {
 	game_data.change_state = 0;
     }
-    pthread_mutex_unlock(&game_data.lock);
+    unlock_game_data();
 }
 
 static void stream_sleep(void) {
-    pthread_mutex_lock(&game_data.lock);
+    lock_game_data();
     game_data.change_stream = 0;
     while (!game_data.change_stream)
-	pthread_cond_wait(&game_data.stream_changed, &game_data.lock);
+	wait_game_data(&game_data.stream_changed);
     game_data.change_stream = 0;
-    pthread_mutex_unlock(&game_data.lock);
+    unlock_game_data();
 }
 
 static int setup_uart(void) {
-    return snd_rawmidi_open(&game_data.input, &game_data.output, UART_NAME, 0);
+    int err;
+
+    if ((err = snd_rawmidi_open(&game_data.input, &game_data.output,
+				    UART_NAME, 0)) < 0) return err;
+
+    /* Reads return whatever has arrived, read_uart() waits in poll() */
+    snd_rawmidi_nonblock(game_data.input, 1);
+    game_data.uart_num_pfds = snd_rawmidi_poll_descriptors(game_data.input,
+		    game_data.uart_pfds, UART_MAX_PFDS);
+
+    protocol_init(&game_data.protocol);
+    return 0;
 }
 
+/* Offers of framing go from the uart thread, everything else from the
+ * stream thread */
+static pthread_mutex_t uart_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void write_uart(uint8_t instruction, uint8_t value) {
-    uint8_t data[PACKET_SIZE];
+    uint8_t data[FRAME_MAX_ENCODED];
+    int len;
 
-    data[0] = PACKET_HEADER;
-    data[1] = instruction;
-    data[2] = value;
+    pthread_mutex_lock(&uart_write_lock);
+    len = protocol_encode(&game_data.protocol, instruction, value, data);
 
-    if (snd_rawmidi_write(game_data.output, data, PACKET_SIZE) < 0) {
+    if (snd_rawmidi_write(game_data.output, data, len) < 0) {
 	printf("error writing\n");
     }
+    pthread_mutex_unlock(&uart_write_lock);
 }
 
-static void read_uart(void) {
-    int err;
-    uint8_t data;
-    static int byte_no;
-    control_packet *new_packet;
-    control_packet *packet_mem;
+typedef struct {
+    control_packet *head, *tail;
+    int count;
+    int64_t time;
+} packet_batch;
+
+static void queue_packet(void *arg, uint8_t instruction, uint8_t value,
+		int64_t age) {
+    packet_batch *batch = (packet_batch *) arg;
+    control_packet *packet;
 
-    if ((err = snd_rawmidi_read(game_data.input, &data, 1)) < 0) {
+    packet = (control_packet *) malloc(sizeof(struct s_control_packet));
+    assert(packet);
+    packet->instruction = instruction;
+    packet->value = value;
+    packet->time = batch->time - age;
+    packet->next = NULL;
+
+    if (batch->tail) batch->tail->next = packet;
+    else batch->head = packet;
+    batch->tail = packet;
+    batch->count++;
+}
+
+static void read_uart(void) {
+    int len;
+    uint8_t data[UART_READ_SIZE];
+    packet_batch batch = { NULL, NULL, 0, 0 };
+
+    if (protocol_poll(&game_data.protocol, game_clock_us()))
+	write_uart(PROTOCOL_NEGOTIATE, PROTOCOL_FRAMED);
+
+    len = snd_rawmidi_read(game_data.input, data, UART_READ_SIZE);
+    if (len == -EAGAIN) {
+	/* Wake up in time to repeat an offer */
+	poll(game_data.uart_pfds, game_data.uart_num_pfds,
+			game_data.protocol.negotiating ?
+				PROTOCOL_OFFER_US / 1000 : -1);
 	return;
     }
-
-    if (data == PACKET_HEADER) byte_no = 0;
-    else byte_no++;
-
-    if (byte_no == 1) {
-	pthread_mutex_lock(&game_data.lock);
-	game_data.cur_instruction = data;
-	pthread_mutex_unlock(&game_data.lock);
-    } else if (byte_no == 2) {
-	/* Add to linked list */
-	packet_mem = (control_packet *) malloc(sizeof(struct s_control_packet));
-	assert(packet_mem);
-	pthread_mutex_lock(&game_data.lock);
-
-	if (!game_data.packet_list) {
-	    game_data.packet_list = packet_mem;
-	    new_packet = game_data.packet_list;
-	} else {
-	    new_packet = game_data.packet_list;
-	    while (new_packet->next) new_packet = new_packet->next;
-	    new_packet->next = packet_mem;
-	    new_packet = new_packet->next;
-	}
-	new_packet->instruction = game_data.cur_instruction;
-	new_packet->value = data;
-	new_packet->next = NULL;
-
-	pthread_cond_signal(&game_data.data_ready);
-	pthread_mutex_unlock(&game_data.lock);
+    if (len < 0) {
+	metrics_count(METRIC_UART_READ_ERRORS, 1);
+	return;
     }
+    metrics_count(METRIC_UART_BYTES, len);
+
+    batch.time = game_clock_us();
+    protocol_parse(&game_data.protocol, data, len, batch.time,
+		    queue_packet, &batch);
+    if (!batch.count) return;
+
+    /* Add everything from this read to the linked list at once */
+    lock_game_data();
+    if (game_data.packet_tail) game_data.packet_tail->next = batch.head;
+    else game_data.packet_list = batch.head;
+    game_data.packet_tail = batch.tail;
+    game_data.packet_count += batch.count;
+
+    wake_game_data(&game_data.data_ready, 0);
+    unlock_game_data();
+    metrics_count(METRIC_UART_PACKETS, batch.count);
 }
 
 static void *uart_func(void *p) {
+    metrics_thread_init("uart");
     while(1) read_uart();
 
     return NULL;
 }
 
+/* Below each controller's offset the curve falls away exponentially, to
+ * around -368000 at a raw value of 0. That's sensor noise rather than
+ * power, so don't let it reach the scores. */
+static int weight_value(int controller, int raw_val) {
+    int weight;
+
+    if (controller == 1)
+	weight = 130.0 * (1.0 - exp(-((raw_val - 114)*1.96) / 240.0)) + 10;
+    else
+	weight = 130.0 * (1.0 - exp(-((raw_val - 217)*8.79) / 240.0)) + 10;
+
+    if (weight < 0) weight = 0;
+    return weight;
+}
+
 static void *data_func(void *p) {
     control_packet *packet;
+    int controller;
+    int weight;
+
+    metrics_thread_init("data");
 
     while (1) {
-	pthread_mutex_lock(&game_data.lock);
+	lock_game_data();
 	/* Wait until we have some packets to read */
 	while (!game_data.packet_list)
-	    pthread_cond_wait(&game_data.data_ready, &game_data.lock);
+	    wait_game_data(&game_data.data_ready);
 	/* Unlink one packet */
 	packet = game_data.packet_list;
 	game_data.packet_list = packet->next;
+	if (!game_data.packet_list) game_data.packet_tail = NULL;
+	game_data.packet_count--;
+	metrics_set(METRIC_QUEUE_DEPTH, game_data.packet_count);
+#ifdef GAME_SIM
+	sim_received(packet->instruction, packet->value);
+#endif
 
 	switch (packet->instruction >> 4) {
 	    case 0x01: /* Digital input */
 		if (packet->value == 1 && ((packet->instruction & 0xf) == 0)) {
 		    if (game_data.allow_start) {
+			sfx_trigger(SFX_START, packet->time);
 			game_data.change_state = 1;
 			game_data.start_game = 1;
 			game_data.allow_start = 0;
-			pthread_cond_broadcast(&game_data.state_changed);
+			wake_game_data(&game_data.state_changed, 1);
 		    }
 		}
 		break;
 	    case 0x02: /* Analogue input */
-		game_data.controller[packet->instruction & 1] = packet->value;
+		controller = packet->instruction & 1;
+		weight = weight_value(controller, packet->value);
+		game_data.controller[controller] = packet->value;
+
+		/* Sound when a player first reaches the threshold */
+		if (game_data.scores[controller].active &&
+			!game_data.power_sound[controller] &&
+			weight >= game_data.score_config.threshold) {
+		    game_data.power_sound[controller] = 1;
+		    sfx_trigger(controller ? SFX_POWER_R : SFX_POWER_L,
+				    packet->time);
+		}
+
+		score_update(&game_data.scores[controller],
+				&game_data.score_config, packet->time, weight);
 		break;
 	}
 
-	pthread_mutex_unlock(&game_data.lock);
+	unlock_game_data();
 
+	metrics_observe(METRIC_PACKET_LATENCY, game_clock_us() - packet->time);
+	metrics_count(METRIC_PACKETS_HANDLED, 1);
 	free(packet);
     }
     return NULL;
@@ -204,7 +388,16 @@ typedef struct {
     dispmanx_element_t		elements[NUM_DISPMANX_ELEMENTS];
 } dispmanx_data_t;
 
+static void submit_update(dispmanx_data_t *vars) {
+    int ret;
+    int64_t start = game_clock_us();
+
+    ret = vc_dispmanx_update_submit_sync( vars->update );
+    assert( ret == 0 );
+    metrics_observe(METRIC_DISPMANX_SUBMIT, game_clock_us() - start);
+}
 
+#ifndef GAME_SIM
 static void fill_rect(	VC_IMAGE_TYPE_T type, 
 			uint16_t *image, 
 			int pitch, 
@@ -221,6 +414,7 @@ static void fill_rect(	VC_IMAGE_TYPE_T type,
         line += (pitch>>1);
     }
 }
+#endif
 
 static void create_square(dispmanx_data_t *vars, int index,
 		int x, int y, int width, int height, uint8_t opacity,
@@ -240,7 +434,11 @@ static void create_square(dispmanx_data_t *vars, int index,
     alpha.opacity = opacity;
     alpha.mask = 0;
 
-    /* Allocate image and convert to VC format */
+    /* Allocate image and convert to VC format. The sim's display never
+     * reads it. */
+#ifdef GAME_SIM
+    image = data;
+#else
     if (data == NULL) {
 	image = (uint16_t *) calloc( 1, pitch * height );
 	assert(image);
@@ -254,6 +452,7 @@ static void create_square(dispmanx_data_t *vars, int index,
 	    fill_rect( type, image, pitch, 0,  0,   
 			width,	    height,	0x07E0 );
     } else image = data;
+#endif
 
     vars->elements[index].resource = vc_dispmanx_resource_create( type,
                                         width,
@@ -288,8 +487,7 @@ static void create_square(dispmanx_data_t *vars, int index,
                                                 (DISPMANX_TRANSFORM_T) 
 						    VC_IMAGE_ROT0 );
 
-    ret = vc_dispmanx_update_submit_sync( vars->update );
-    assert( ret == 0 );
+    submit_update(vars);
 }
 
 static void destroy_square(dispmanx_data_t *vars, int index) {
@@ -299,8 +497,7 @@ static void destroy_square(dispmanx_data_t *vars, int index) {
     ret = vc_dispmanx_element_remove( vars->update, 
 		    vars->elements[index].element );
     assert( ret == 0 );
-    ret = vc_dispmanx_update_submit_sync( vars->update );
-    assert( ret == 0 );
+    submit_update(vars);
     ret = vc_dispmanx_resource_delete( vars->elements[index].resource );
     assert( ret == 0 );
 }
@@ -329,8 +526,7 @@ static void set_visibility(dispmanx_data_t *vars, int index, int visible) {
 		    vars->elements[index].element,
 		    visible ? OVERLAY_LAYER : OVERLAY_LAYER_HIDDEN);
     assert( ret == 0 );
-    ret = vc_dispmanx_update_submit_sync( vars->update );
-    assert( ret == 0 );
+    submit_update(vars);
 }
 
 static void toggle_visibility(dispmanx_data_t *vars, 
@@ -347,8 +543,7 @@ static void toggle_visibility(dispmanx_data_t *vars,
 		    vars->elements[index_2].element,
 		    visible_2 ? OVERLAY_LAYER : OVERLAY_LAYER_HIDDEN);
     assert( ret == 0 );
-    ret = vc_dispmanx_update_submit_sync( vars->update );
-    assert( ret == 0 );
+    submit_update(vars);
 }
 
 
@@ -405,20 +600,12 @@ static void power_bar(dispmanx_data_t *dispmanx_data, int index, int power) {
 
 static int controller_weight(int controller) {
     int raw_val;
-    int weighted_val;
 
-    pthread_mutex_lock(&game_data.lock);
+    lock_game_data();
     raw_val = game_data.controller[controller & 1];
-    if (controller == 1)
-	weighted_val = 
-		130.0 * (1.0 - exp(-((raw_val - 114)*1.96) / 240.0)) + 10;
-    else
-	weighted_val = 
-		130.0 * (1.0 - exp(-((raw_val - 217)*8.79) / 240.0)) + 10;
-    game_data.score[controller & 1] = weighted_val;
-    pthread_mutex_unlock(&game_data.lock);
+    unlock_game_data();
 
-    return weighted_val;
+    return weight_value(controller, raw_val);
 }
 
 static void update_power_bars(dispmanx_data_t *dispmanx_data) {
@@ -432,7 +619,7 @@ static void update_power_bars(dispmanx_data_t *dispmanx_data) {
     int power_level_r;
 
     while (1) {
-	pthread_mutex_lock(&game_data.lock);
+	lock_game_data();
 	if (game_data.finish_overlay) {
 	    game_data.finish_overlay = 0;
 	    exit = 1;
@@ -441,7 +628,7 @@ static void update_power_bars(dispmanx_data_t *dispmanx_data) {
 	    game_data.pause_overlay = 0;
 	    pause = 1;
 	}
-	pthread_mutex_unlock(&game_data.lock);
+	unlock_game_data();
 
 	if (exit) {
 	    if (destroy_layer_2) {
@@ -457,7 +644,7 @@ static void update_power_bars(dispmanx_data_t *dispmanx_data) {
 	}
 
 	if (pause) {
-	    usleep(10000);
+	    game_sleep_us(10000);
 	    continue;
 	}
 
@@ -503,6 +690,7 @@ static void update_power_bars(dispmanx_data_t *dispmanx_data) {
 
 	    current_layer = 1;
 	}
+	metrics_count(METRIC_OVERLAY_FRAMES, 1);
     }
 }
 
@@ -510,16 +698,17 @@ static void *overlay_func(void *p) {
     dispmanx_data_t dispmanx_data;
     uint16_t **overlays = (uint16_t **) p;
 
+    metrics_thread_init("overlay");
     state_sleep(0);
     init_overlay(&dispmanx_data, OVERLAY_DISPLAY);
 
     while (1) {
 	/* Wait for correct game stream */
-	pthread_mutex_lock(&game_data.lock);
+	lock_game_data();
 	while (!game_data.start_overlay)
-	    pthread_cond_wait(&game_data.stream_changed, &game_data.lock);
+	    wait_game_data(&game_data.stream_changed);
 	game_data.start_overlay = 0;
-	pthread_mutex_unlock(&game_data.lock);
+	unlock_game_data();
 
 	show_overlays(&dispmanx_data, overlays);
 
@@ -534,11 +723,85 @@ static void *overlay_func(void *p) {
     return NULL;
 }
 
+/* Called with game_data.lock held. start is when the first frame of the
+ * game stream was shown, on the game clock, or failing that when we
+ * switched to it. */
+static void start_scoring(int64_t start) {
+    int i;
+
+    for (i = 0; i < NUM_CONTROLLERS; i++) {
+	score_reset(&game_data.scores[i], &game_data.score_config, start,
+			weight_value(i, game_data.controller[i]));
+	game_data.power_sound[i] = 0;
+    }
+}
+
+/* Sleep until the game window has closed, or give up if it never opened */
+static void score_sleep(void) {
+    int64_t now, cutoff;
+    int64_t give_up = game_clock_us() + game_data.score_config.window_us;
+
+    while (1) {
+	lock_game_data();
+	cutoff = game_data.scores[0].active ? game_data.scores[0].cutoff : 0;
+	unlock_game_data();
+
+	now = game_clock_us();
+	if (cutoff) {
+	    if (now >= cutoff + SCORE_GRACE_US) return;
+	    game_sleep_us(cutoff + SCORE_GRACE_US - now);
+	} else {
+	    if (now >= give_up) return;
+	    game_sleep_us(10000);
+	}
+    }
+}
+
+/* Make the final scores available to displays through the metrics */
+static void publish_scores(int controller) {
+    int m;
+    double value;
+    enum metric_gauge gauge;
+
+    for (m = 0; m < NUM_SCORE_METRICS; m++) {
+	value = score_value(&game_data.scores[controller],
+			(enum score_metric) m);
+	if (m == SCORE_METRIC_SUSTAINED) value *= 1000;
+	gauge = (enum metric_gauge) (METRIC_PLAYER1_PEAK +
+			controller * NUM_SCORE_METRICS + m);
+	metrics_set(gauge, llround(value));
+    }
+}
+
+/* Called with game_data.lock held */
 static int choose_winner(void) {
+    int i;
     int retval;
+    char buf[128];
+    enum score_metric metric = game_data.score_config.metric;
+
+    /* The scores are still the last game's, treat it as a tie */
+    if (!game_data.scores[0].active) {
+	game_log("Score window never opened\n");
+	return 1;
+    }
+    if (game_data.scores_from_switch)
+	game_log("No media clock for the game stream, "
+			"scored from the switch\n");
+
+    for (i = 0; i < NUM_CONTROLLERS; i++) {
+	score_finish(&game_data.scores[i], &game_data.score_config);
+	score_format(&game_data.scores[i], buf, sizeof(buf));
+	game_log("Player %d: %s\n", i + 1, buf);
+	publish_scores(i);
+    }
     
-    if (game_data.score[0] > game_data.score[1]) retval = 0;
+    if (score_value(&game_data.scores[0], metric) >
+		    score_value(&game_data.scores[1], metric)) retval = 0;
     else retval = 1;
+
+    game_log("Winner by %s: player %d\n", score_metric_name(metric),
+		    retval + 1);
     
     return retval;
 }
@@ -564,16 +827,19 @@ static enum state_enum get_game_state(enum state_enum old_state) {
 }
 
 static void set_stream(int stream) {
-    pthread_mutex_lock(&game_data.lock);
+    lock_game_data();
     game_data.stream = stream;
-    pthread_mutex_unlock(&game_data.lock);
+    game_data.stream_request = game_clock_us();
+    unlock_game_data();
 }
 
 static void *stream_func(void *p) {
+    metrics_thread_init("stream");
+
     while (1) {
-	pthread_mutex_lock(&game_data.lock);
+	lock_game_data();
 	game_data.state = get_game_state(game_data.state);
-	pthread_mutex_unlock(&game_data.lock);
+	unlock_game_data();
 	switch (game_data.state) {
 	    case ATTRACT_MODE:
 		set_stream(ATTRACT_STREAM);
@@ -587,26 +853,26 @@ static void *stream_func(void *p) {
 
 	    case GAME_MODE:
 		set_stream(GAME_STREAM);
-		pthread_mutex_lock(&game_data.lock);
+		lock_game_data();
 		game_data.start_overlay = 1;
-		pthread_mutex_unlock(&game_data.lock);
+		unlock_game_data();
 
 		stream_sleep();
-		sleep(7);
+		score_sleep();
 
-		pthread_mutex_lock(&game_data.lock);
+		lock_game_data();
 		game_data.pause_overlay = 1;
 		game_data.winner = choose_winner();
-		pthread_mutex_unlock(&game_data.lock);
-		sleep(1);
+		unlock_game_data();
+		game_sleep_us(1000000);
 		
 		state_sleep(1);
 
-		pthread_mutex_lock(&game_data.lock);
+		lock_game_data();
 		game_data.finish_overlay = 1;
 		game_data.start_game = 0;
 		game_data.allow_start = 1;
-		pthread_mutex_unlock(&game_data.lock);
+		unlock_game_data();
 		break;
 
 	    case WINNER1_MODE:
@@ -628,38 +894,73 @@ static void *stream_func(void *p) {
     return NULL;
 }
 
+/* The player seeks and flushes after the callback which switches streams,
+ * so the window can't open until a later one, once the media clock shows
+ * the game stream playing from the top. Without a media clock it opens on
+ * the callback after the switch. Until then it runs from the switch, in
+ * case the media clock never gets there. */
+static int scoring_pending;
+
+static void check_scoring(int64_t now) {
+    int64_t media = OMXPlayerInterface::get_interface()->media_time();
+
+    /* Still paused at the start, or not seeked yet */
+    if (media == 0 || media >= SCORE_START_MAX_US) return;
+    if (media < 0) media = 0;
+
+    lock_game_data();
+    start_scoring(now - media);
+    game_data.scores_from_switch = 0;
+    unlock_game_data();
+    scoring_pending = 0;
+}
+
 static int control_callback(OMXReader *reader) {
     int stream;
     static int old_stream;
     int reset = 0;
+    int64_t request;
 
-    pthread_mutex_lock(&game_data.lock);
+    lock_game_data();
     stream = game_data.stream;
-    pthread_mutex_unlock(&game_data.lock);
+    request = game_data.stream_request;
+    unlock_game_data();
 
     if (stream != old_stream) {
 	reader->SetActiveStream(OMXSTREAM_VIDEO, stream);
 	reader->SetActiveStream(OMXSTREAM_AUDIO, stream);
 	reset = 1;
-    }
+	metrics_observe(METRIC_STREAM_SWITCH, game_clock_us() - request);
+	metrics_count(METRIC_STREAM_SWITCHES, 1);
+
+	scoring_pending = (stream == GAME_STREAM);
+	if (scoring_pending) {
+	    lock_game_data();
+	    start_scoring(game_clock_us());
+	    game_data.scores_from_switch = 1;
+	    unlock_game_data();
+	}
+    } else if (scoring_pending) check_scoring(game_clock_us());
 
     old_stream = stream;
     return reset;
 }
 
 static int loop_callback(OMXReader *reader) {
-    pthread_mutex_lock(&game_data.lock);
+    metrics_count(METRIC_STREAM_LOOPS, 1);
+
+    lock_game_data();
     game_data.change_state = 1;
-    pthread_cond_broadcast(&game_data.state_changed);
-    pthread_mutex_unlock(&game_data.lock);
+    wake_game_data(&game_data.state_changed, 1);
+    unlock_game_data();
 
-    usleep(6000000);
+    game_sleep_us(6000000);
 
-    pthread_mutex_lock(&game_data.lock);
+    lock_game_data();
     game_data.stream_state = game_data.state;
     game_data.change_stream = 1;
-    pthread_cond_broadcast(&game_data.stream_changed);
-    pthread_mutex_unlock(&game_data.lock);
+    wake_game_data(&game_data.stream_changed, 1);
+    unlock_game_data();
     return 1;
 }
 
@@ -686,7 +987,12 @@ static int read_overlay_data(const char *filename, uint16_t ***overlays) {
 #define OMX_PLAYER_ARGS	2
 #define OMX_PLAYER_ARG0	"omx_game"
 #define OMX_PLAYER_ARG1 "/home/pi/media.mp4"
+#ifdef GAME_SIM
+/* Blank overlays */
+#define OVERLAY_DATA "/dev/null"
+#else
 #define OVERLAY_DATA "/home/pi/overlays.rgb565"
+#endif
 int main(void) {
     int argc = OMX_PLAYER_ARGS;
     char *argv[OMX_PLAYER_ARGS] = { 
@@ -705,7 +1011,13 @@ int main(void) {
 	return 1;
     }
 
+    /* Stays on the 3 byte packets unless the controller acknowledges,
+     * the uart thread sends the offer */
+    if (!getenv("GAME_UART_LEGACY")) protocol_offer(&game_data.protocol);
+
     game_data.packet_list = NULL,
+    game_data.packet_tail = NULL,
+    game_data.packet_count = 0,
     game_data.start_game = 0,
     game_data.allow_start = 1,
     game_data.change_state = 0,
@@ -716,11 +1028,24 @@ int main(void) {
     game_data.start_overlay = 0;
     game_data.pause_overlay = 0;
     game_data.finish_overlay = 0;
+    score_config_init(&game_data.score_config);
+
+    /* The player calls back from this thread */
+    metrics_thread_init("player");
+#ifndef GAME_SIM
+    if (metrics_start_server() < 0) {
+	printf("Unable to open metrics socket\n");
+    }
+#endif
+
+    if (sfx_init() < 0) {
+	printf("Sound effects disabled\n");
+    }
 
-    pthread_create(&stream_thread, NULL, stream_func, NULL);
-    pthread_create(&overlay_thread, NULL, overlay_func, overlays);
-    pthread_create(&uart_thread, NULL, uart_func, NULL);
-    pthread_create(&data_thread, NULL, data_func, NULL);
+    start_thread(&stream_thread, stream_func, NULL);
+    start_thread(&overlay_thread, overlay_func, overlays);
+    start_thread(&uart_thread, uart_func, NULL);
+    start_thread(&data_thread, data_func, NULL);
     
     player = OMXPlayerInterface::get_interface();
     player->set_callback(control_callback);
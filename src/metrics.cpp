@@ -0,0 +1,283 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+/* Written only by the owning thread, read by the server without locking.
+ * Aligned so that threads don't share cache lines. */
+typedef struct {
+    const char *name;
+    int ready;
+    uint64_t counters[NUM_METRIC_COUNTERS];
+    uint64_t buckets[NUM_METRIC_HISTOGRAMS][METRICS_BUCKETS];
+    int64_t sums[NUM_METRIC_HISTOGRAMS];
+} __attribute__((aligned(64))) metrics_thread_t;
+
+static metrics_thread_t metrics_threads[METRICS_MAX_THREADS];
+static int metrics_num_threads;
+static int64_t metrics_gauges[NUM_METRIC_GAUGES];
+static __thread metrics_thread_t *metrics_self;
+
+static const char *counter_names[NUM_METRIC_COUNTERS] = {
+    "game_uart_bytes_total",
+    "game_uart_read_errors_total",
+    "game_uart_parse_errors_total",
+    "game_uart_packets_total",
+    "game_packets_handled_total",
+    "game_overlay_frames_total",
+    "game_stream_switches_total",
+    "game_stream_loops_total",
+    "game_sfx_triggers_total",
+    "game_sfx_underruns_total",
+    "game_uart_frames_total",
+    "game_uart_crc_errors_total",
+    "game_uart_lost_frames_total",
+};
+
+static const char *gauge_names[NUM_METRIC_GAUGES] = {
+    "game_packet_queue_depth",
+    "game_player1_peak",
+    "game_player1_energy",
+    "game_player1_mean",
+    "game_player1_sustained_ms",
+    "game_player2_peak",
+    "game_player2_energy",
+    "game_player2_mean",
+    "game_player2_sustained_ms",
+};
+
+static const char *histogram_names[NUM_METRIC_HISTOGRAMS] = {
+    "game_packet_latency_us",
+    "game_dispmanx_submit_us",
+    "game_stream_switch_us",
+    "game_lock_hold_us",
+    "game_sfx_latency_us",
+};
+
+/* The 64-bit values load and store with ldrexd/strexd. Plain ARMv6 has
+ * neither, and GCC would call libatomic instead, see the Makefile. */
+#if defined(__ARM_ARCH_6__) || defined(__ARM_ARCH_6J__) || \
+	defined(__ARM_ARCH_6Z__)
+#error "64-bit atomics need ARMv6K or later, build with -march=armv6zk"
+#endif
+
+#define LOAD(x)	    __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+void metrics_thread_init(const char *name) {
+    int index = __atomic_fetch_add(&metrics_num_threads, 1, __ATOMIC_RELAXED);
+
+    if (index >= METRICS_MAX_THREADS) {
+	printf("Too many metrics threads, ignoring %s\n", name);
+	return;
+    }
+
+    metrics_self = &metrics_threads[index];
+    metrics_self->name = name;
+    __atomic_store_n(&metrics_self->ready, 1, __ATOMIC_RELEASE);
+}
+
+/* Single writer, so a plain load and store is enough */
+void metrics_count(enum metric_counter counter, uint64_t n) {
+    metrics_thread_t *self = metrics_self;
+
+    if (!self) return;
+    STORE(self->counters[counter], LOAD(self->counters[counter]) + n);
+}
+
+void metrics_set(enum metric_gauge gauge, int64_t value) {
+    STORE(metrics_gauges[gauge], value);
+}
+
+static int bucket_index(int64_t value) {
+    int index;
+
+    if (value <= 1) return 0;
+    index = 64 - __builtin_clzll(value - 1);
+    if (index >= METRICS_BUCKETS) index = METRICS_BUCKETS - 1;
+    return index;
+}
+
+void metrics_observe(enum metric_histogram histogram, int64_t value) {
+    metrics_thread_t *self = metrics_self;
+    int index;
+
+    if (!self) return;
+    if (value < 0) value = 0;
+    index = bucket_index(value);
+    STORE(self->buckets[histogram][index],
+		    LOAD(self->buckets[histogram][index]) + 1);
+    STORE(self->sums[histogram], LOAD(self->sums[histogram]) + value);
+}
+
+static int append(char *buf, int len, int pos, const char *fmt, ...) {
+    va_list ap;
+    int ret;
+
+    if (pos >= len) return pos;
+    va_start(ap, fmt);
+    ret = vsnprintf(buf + pos, len - pos, fmt, ap);
+    va_end(ap);
+    if (ret < 0) return pos;
+    return pos + ret;
+}
+
+static int num_ready_threads(void) {
+    int n = __atomic_load_n(&metrics_num_threads, __ATOMIC_RELAXED);
+    if (n > METRICS_MAX_THREADS) n = METRICS_MAX_THREADS;
+    return n;
+}
+
+static int thread_ready(int i) {
+    return __atomic_load_n(&metrics_threads[i].ready, __ATOMIC_ACQUIRE);
+}
+
+static uint64_t sum_counter(int counter) {
+    int i;
+    uint64_t total = 0;
+
+    for (i = 0; i < num_ready_threads(); i++)
+	if (thread_ready(i))
+	    total += LOAD(metrics_threads[i].counters[counter]);
+    return total;
+}
+
+static uint64_t sum_bucket(int histogram, int bucket) {
+    int i;
+    uint64_t total = 0;
+
+    for (i = 0; i < num_ready_threads(); i++)
+	if (thread_ready(i))
+	    total += LOAD(metrics_threads[i].buckets[histogram][bucket]);
+    return total;
+}
+
+static int64_t sum_histogram(int histogram) {
+    int i;
+    int64_t total = 0;
+
+    for (i = 0; i < num_ready_threads(); i++)
+	if (thread_ready(i))
+	    total += LOAD(metrics_threads[i].sums[histogram]);
+    return total;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Rates are taken over the interval since the previous call, so this must
+ * only be called from one thread. */
+int metrics_format(char *buf, int len) {
+    static double last_time;
+    static uint64_t last_packets, last_frames;
+    int pos = 0;
+    int h, b, i;
+    uint64_t count, packets, frames;
+    double now, elapsed;
+
+    for (i = 0; i < NUM_METRIC_COUNTERS; i++) {
+	pos = append(buf, len, pos, "# TYPE %s counter\n%s %llu\n",
+			counter_names[i], counter_names[i],
+			(unsigned long long) sum_counter(i));
+    }
+
+    for (i = 0; i < NUM_METRIC_GAUGES; i++) {
+	pos = append(buf, len, pos, "# TYPE %s gauge\n%s %lld\n",
+			gauge_names[i], gauge_names[i],
+			(long long) LOAD(metrics_gauges[i]));
+    }
+
+    for (h = 0; h < NUM_METRIC_HISTOGRAMS; h++) {
+	pos = append(buf, len, pos, "# TYPE %s histogram\n",
+			histogram_names[h]);
+	count = 0;
+	for (b = 0; b < METRICS_BUCKETS; b++) {
+	    count += sum_bucket(h, b);
+	    if (b == METRICS_BUCKETS - 1)
+		pos = append(buf, len, pos,
+				"%s_bucket{le=\"+Inf\"} %llu\n",
+				histogram_names[h], (unsigned long long) count);
+	    else
+		pos = append(buf, len, pos, "%s_bucket{le=\"%u\"} %llu\n",
+				histogram_names[h], 1u << b,
+				(unsigned long long) count);
+	}
+	pos = append(buf, len, pos, "%s_sum %lld\n%s_count %llu\n",
+			histogram_names[h], (long long) sum_histogram(h),
+			histogram_names[h], (unsigned long long) count);
+    }
+
+    now = now_seconds();
+    packets = sum_counter(METRIC_UART_PACKETS);
+    frames = sum_counter(METRIC_OVERLAY_FRAMES);
+    elapsed = now - last_time;
+    if (last_time && elapsed > 0) {
+	pos = append(buf, len, pos,
+			"# TYPE game_uart_packets_per_second gauge\n"
+			"game_uart_packets_per_second %.1f\n"
+			"# TYPE game_overlay_frames_per_second gauge\n"
+			"game_overlay_frames_per_second %.1f\n",
+			(packets - last_packets) / elapsed,
+			(frames - last_frames) / elapsed);
+    }
+    last_time = now;
+    last_packets = packets;
+    last_frames = frames;
+
+    return pos < len ? pos : len - 1;
+}
+
+#define METRICS_BUF_SIZE 16384
+static void *metrics_func(void *p) {
+    int sock = (int) (intptr_t) p;
+    int client;
+    int len;
+    static char buf[METRICS_BUF_SIZE];
+
+    while (1) {
+	if ((client = accept(sock, NULL, NULL)) < 0) continue;
+	len = metrics_format(buf, METRICS_BUF_SIZE);
+	send(client, buf, len, MSG_NOSIGNAL);
+	close(client);
+    }
+
+    return NULL;
+}
+
+/* Serve the text exposition to anyone who connects to the socket */
+int metrics_start_server(void) {
+    int sock;
+    const char *path;
+    struct sockaddr_un addr;
+    pthread_t metrics_thread;
+
+    if (!(path = getenv("GAME_METRICS_SOCKET"))) path = METRICS_SOCKET;
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+		    listen(sock, 4) < 0) {
+	close(sock);
+	return -1;
+    }
+
+    pthread_create(&metrics_thread, NULL, metrics_func,
+		    (void *) (intptr_t) sock);
+    return 0;
+}
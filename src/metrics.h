@@ -0,0 +1,50 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_SOCKET		"/tmp/omxgame.sock"
+#define METRICS_MAX_THREADS	8
+/* Power of two microsecond buckets up to ~0.5s, plus +Inf */
+#define METRICS_BUCKETS		21
+
+enum metric_counter {
+    METRIC_UART_BYTES, METRIC_UART_READ_ERRORS, METRIC_UART_PARSE_ERRORS,
+    METRIC_UART_PACKETS, METRIC_PACKETS_HANDLED, METRIC_OVERLAY_FRAMES,
+    METRIC_STREAM_SWITCHES, METRIC_STREAM_LOOPS, METRIC_SFX_TRIGGERS,
+    METRIC_SFX_UNDERRUNS, METRIC_UART_FRAMES, METRIC_UART_CRC_ERRORS,
+    METRIC_UART_LOST_FRAMES,
+    NUM_METRIC_COUNTERS
+};
+
+enum metric_gauge {
+    METRIC_QUEUE_DEPTH,
+    /* The last game's scores, in score_metric order for each player.
+     * Sustained time is in milliseconds. */
+    METRIC_PLAYER1_PEAK, METRIC_PLAYER1_ENERGY, METRIC_PLAYER1_MEAN,
+    METRIC_PLAYER1_SUSTAINED,
+    METRIC_PLAYER2_PEAK, METRIC_PLAYER2_ENERGY, METRIC_PLAYER2_MEAN,
+    METRIC_PLAYER2_SUSTAINED,
+    NUM_METRIC_GAUGES
+};
+
+/* All histograms are in microseconds. Lock hold times are sampled, so
+ * their count is a fraction of the acquisitions. */
+enum metric_histogram {
+    METRIC_PACKET_LATENCY, METRIC_DISPMANX_SUBMIT, METRIC_STREAM_SWITCH,
+    METRIC_LOCK_HOLD, METRIC_SFX_LATENCY,
+    NUM_METRIC_HISTOGRAMS
+};
+
+/* Instruments only write to the calling thread's block, which must have
+ * been set up with metrics_thread_init(). Calls from other threads are
+ * ignored. */
+void metrics_thread_init(const char *name);
+void metrics_count(enum metric_counter counter, uint64_t n);
+void metrics_set(enum metric_gauge gauge, int64_t value);
+void metrics_observe(enum metric_histogram histogram, int64_t value);
+
+int metrics_format(char *buf, int len);
+int metrics_start_server(void);
+
+#endif
@@ -0,0 +1,92 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "metrics.h"
+
+/* Measures what the instrumentation costs per call, to be run on the Pi.
+ * The lock cases repeat the pattern of lock_game_data() and
+ * unlock_game_data() in game.cpp. */
+
+#define BENCH_ITERATIONS	1000000
+#define BENCH_SCRAPES		1000
+#define LOCK_SAMPLE_PERIOD	16
+
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int64_t bench_sink;
+
+static int64_t clock_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, double start, int n) {
+    printf("%-28s %8.1f ns\n", name, (clock_ns() - start) / n);
+}
+
+int main(void) {
+    int i;
+    int64_t lock_time;
+    double start;
+    static char buf[16384];
+
+    metrics_thread_init("bench");
+
+    start = clock_ns();
+    for (i = 0; i < BENCH_ITERATIONS; i++) bench_sink = clock_us();
+    report("clock read", start, BENCH_ITERATIONS);
+
+    start = clock_ns();
+    for (i = 0; i < BENCH_ITERATIONS; i++)
+	metrics_count(METRIC_UART_BYTES, 1);
+    report("metrics_count", start, BENCH_ITERATIONS);
+
+    start = clock_ns();
+    for (i = 0; i < BENCH_ITERATIONS; i++)
+	metrics_observe(METRIC_PACKET_LATENCY, i & 0xfff);
+    report("metrics_observe", start, BENCH_ITERATIONS);
+
+    start = clock_ns();
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+	pthread_mutex_lock(&bench_lock);
+	pthread_mutex_unlock(&bench_lock);
+    }
+    report("lock, untimed", start, BENCH_ITERATIONS);
+
+    start = clock_ns();
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+	pthread_mutex_lock(&bench_lock);
+	lock_time = clock_us();
+	metrics_observe(METRIC_LOCK_HOLD, clock_us() - lock_time);
+	pthread_mutex_unlock(&bench_lock);
+    }
+    report("lock, every hold timed", start, BENCH_ITERATIONS);
+
+    start = clock_ns();
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+	pthread_mutex_lock(&bench_lock);
+	if ((i + 1) % LOCK_SAMPLE_PERIOD) lock_time = 0;
+	else lock_time = clock_us();
+	if (lock_time)
+	    metrics_observe(METRIC_LOCK_HOLD, clock_us() - lock_time);
+	pthread_mutex_unlock(&bench_lock);
+    }
+    report("lock, sampled", start, BENCH_ITERATIONS);
+
+    start = clock_ns();
+    for (i = 0; i < BENCH_SCRAPES; i++)
+	bench_sink = metrics_format(buf, sizeof(buf));
+    report("scrape", start, BENCH_SCRAPES);
+
+    return 0;
+}
@@ -2,7 +2,8 @@ class OMXPlayerInterface {
     typedef int (*callback_func_t)(OMXReader *reader);
 
     public:
-	OMXPlayerInterface() : callback_func(), loop_func() {}
+	OMXPlayerInterface() : callback_func(), loop_func(),
+		media_time_us(-1) {}
 
 	void set_callback(callback_func_t func) {
 	    callback_func = func;
@@ -12,6 +13,16 @@ class OMXPlayerInterface {
 	    loop_func = func;
 	}
 
+	/* Position of the playing stream in microseconds, updated before
+	 * each control callback. -1 if the player doesn't provide it. */
+	int64_t media_time() {
+	    return media_time_us;
+	}
+
+	void set_media_time(int64_t us) {
+	    media_time_us = us;
+	}
+
 	static OMXPlayerInterface *get_interface();
 	int omxplay_event_loop(int argc, char *argv[]);
 
@@ -28,4 +39,5 @@ class OMXPlayerInterface {
 
 	callback_func_t callback_func;
 	callback_func_t loop_func;
+	int64_t media_time_us;
 };
@@ -0,0 +1,347 @@
+#include <string.h>
+
+#include "protocol.h"
+#include "metrics.h"
+
+#define CRC_POLY 0x1021
+static uint16_t crc_table[256];
+
+static void crc_init(void) {
+    int i, bit;
+    uint16_t crc;
+
+    for (i = 0; i < 256; i++) {
+	crc = i << 8;
+	for (bit = 0; bit < 8; bit++)
+	    crc = (crc & 0x8000) ? (crc << 1) ^ CRC_POLY : crc << 1;
+	crc_table[i] = crc;
+    }
+}
+
+static uint16_t crc16(const uint8_t *data, int len) {
+    uint16_t crc = 0xffff;
+
+    while (len--)
+	crc = (crc << 8) ^ crc_table[(crc >> 8) ^ *data++];
+    return crc;
+}
+
+/* Appends the delimiter, returns the encoded length */
+static int cobs_encode(const uint8_t *in, int len, uint8_t *out) {
+    int i;
+    int code_pos = 0;
+    int o = 1;
+    uint8_t code = 1;
+
+    for (i = 0; i < len; i++) {
+	if (in[i]) {
+	    out[o++] = in[i];
+	    code++;
+	}
+	if (!in[i] || code == 0xff) {
+	    out[code_pos] = code;
+	    code_pos = o++;
+	    code = 1;
+	}
+    }
+    out[code_pos] = code;
+    out[o++] = 0;
+
+    return o;
+}
+
+/* May decode in place, returns -1 if the frame is malformed */
+static int cobs_decode(const uint8_t *in, int len, uint8_t *out) {
+    int i = 0;
+    int o = 0;
+    int code, j;
+
+    while (i < len) {
+	code = in[i++];
+	if (!code || i + code - 1 > len) return -1;
+	for (j = 1; j < code; j++) out[o++] = in[i++];
+	if (code < 0xff && i < len) out[o++] = 0;
+    }
+
+    return o;
+}
+
+void protocol_init(protocol_t *protocol) {
+    memset(protocol, 0, sizeof(protocol_t));
+    protocol->mode = PROTOCOL_LEGACY;
+    if (!crc_table[1]) crc_init();
+}
+
+/* Start offering framing, see protocol_poll() */
+void protocol_offer(protocol_t *protocol) {
+    protocol->negotiating = 1;
+    protocol->offers = 0;
+    protocol->next_offer = 0;
+    protocol->frame_len = 0;
+}
+
+static void start_framing(protocol_t *protocol) {
+    protocol->negotiating = 0;
+    protocol->frame_len = 0;
+    protocol->bad_frames = 0;
+    protocol->unframed_bytes = 0;
+    protocol->have_seq = 0;
+    __atomic_store_n(&protocol->mode, PROTOCOL_FRAMED, __ATOMIC_RELEASE);
+}
+
+/* The controller has probably reset, go back to version 1 and offer
+ * framing again */
+static void fall_back(protocol_t *protocol) {
+    protocol->bad_frames = 0;
+    protocol->unframed_bytes = 0;
+    protocol->unframed_since = 0;
+    protocol->have_seq = 0;
+    protocol->byte_no = PACKET_SIZE;
+    __atomic_store_n(&protocol->mode, PROTOCOL_LEGACY, __ATOMIC_RELEASE);
+    protocol_offer(protocol);
+}
+
+/* Called from the receiving thread before each read. Returns 1 if the
+ * caller should send PROTOCOL_NEGOTIATE now. */
+int protocol_poll(protocol_t *protocol, int64_t now) {
+    if (!protocol->negotiating || protocol->mode != PROTOCOL_LEGACY)
+	return 0;
+    if (protocol->offers >= PROTOCOL_OFFER_TRIES) {
+	protocol->negotiating = 0;
+	return 0;
+    }
+    if (now < protocol->next_offer) return 0;
+
+    protocol->offers++;
+    protocol->next_offer = now + PROTOCOL_OFFER_US;
+    return 1;
+}
+
+/* The mode changes on the receiving thread, so may be read from others */
+int protocol_mode(protocol_t *protocol) {
+    return __atomic_load_n(&protocol->mode, __ATOMIC_ACQUIRE);
+}
+
+static void bad_frame(protocol_t *protocol) {
+    if (++protocol->bad_frames >= PROTOCOL_MAX_BAD_FRAMES)
+	fall_back(protocol);
+}
+
+#define FRAME_MALFORMED		-1
+#define FRAME_BAD_CRC		-2
+
+/* Decodes the frame in place. Returns the decoded length, or
+ * FRAME_MALFORMED or FRAME_BAD_CRC. */
+static int decode_frame(protocol_t *protocol) {
+    uint8_t *frame = protocol->frame;
+    int len;
+
+    len = cobs_decode(frame, protocol->frame_len, frame);
+    if (len < FRAME_HEADER_SIZE + FRAME_CRC_SIZE ||
+		    (frame[0] >> 4) != PROTOCOL_FRAMED ||
+		    len != FRAME_HEADER_SIZE + frame[2] + FRAME_CRC_SIZE)
+	return FRAME_MALFORMED;
+
+    if (crc16(frame, len - FRAME_CRC_SIZE) !=
+		    ((frame[len - 2] << 8) | frame[len - 1]))
+	return FRAME_BAD_CRC;
+
+    return len;
+}
+
+/* Passes on the contents of a decoded frame */
+static void deliver_frame(protocol_t *protocol, protocol_func_t func,
+		void *arg) {
+    uint8_t *frame = protocol->frame;
+    const uint8_t *body = frame + FRAME_HEADER_SIZE;
+    int body_len = frame[2];
+    int i, s, c;
+    int first, channels, samples, period;
+
+    if (protocol->have_seq && frame[1] != protocol->rx_seq)
+	metrics_count(METRIC_UART_LOST_FRAMES,
+			(uint8_t) (frame[1] - protocol->rx_seq));
+    protocol->rx_seq = frame[1] + 1;
+    protocol->have_seq = 1;
+    metrics_count(METRIC_UART_FRAMES, 1);
+
+    switch (frame[0] & 0xf) {
+	case FRAME_EVENTS:
+	    for (i = 0; i + 1 < body_len; i += 2)
+		func(arg, body[i], body[i + 1], 0);
+	    break;
+	case FRAME_ANALOGUE:
+	    if (body_len < 4) break;
+	    first = body[0];
+	    channels = body[1];
+	    samples = body[2];
+	    period = body[3] * 100;
+	    if (body_len != 4 + channels * samples) {
+		metrics_count(METRIC_UART_PARSE_ERRORS, 1);
+		break;
+	    }
+	    body += 4;
+	    for (s = 0; s < samples; s++)
+		for (c = 0; c < channels; c++)
+		    func(arg, 0x20 | ((first + c) & 0xf), *body++,
+				    (int64_t) (samples - 1 - s) * period);
+	    break;
+	default:
+	    metrics_count(METRIC_UART_PARSE_ERRORS, 1);
+	    break;
+    }
+}
+
+static void handle_frame(protocol_t *protocol, protocol_func_t func,
+		void *arg) {
+    int len = decode_frame(protocol);
+
+    if (len < 0) {
+	metrics_count(len == FRAME_BAD_CRC ? METRIC_UART_CRC_ERRORS :
+			METRIC_UART_PARSE_ERRORS, 1);
+	bad_frame(protocol);
+	return;
+    }
+    protocol->bad_frames = 0;
+    deliver_frame(protocol, func, arg);
+}
+
+static void parse_framed(protocol_t *protocol, uint8_t data,
+		protocol_func_t func, void *arg) {
+    protocol->unframed_bytes++;
+    if (data == 0) {
+	if (protocol->frame_len > 0) handle_frame(protocol, func, arg);
+	protocol->frame_len = 0;
+	protocol->unframed_bytes = 0;
+	return;
+    }
+
+    /* Too long, drop everything up to the next delimiter. A negative
+     * length counts what we've dropped, each frame's worth of which is
+     * another bad frame. */
+    if (protocol->frame_len < 0) {
+	if (--protocol->frame_len > -FRAME_MAX_ENCODED) return;
+	protocol->frame_len = 0;
+    }
+    if (protocol->frame_len == FRAME_MAX_ENCODED) {
+	metrics_count(METRIC_UART_PARSE_ERRORS, 1);
+	protocol->frame_len = -1;
+	bad_frame(protocol);
+	return;
+    }
+
+    protocol->frame[protocol->frame_len++] = data;
+}
+
+/* While we're offering, the controller may already be framing if its
+ * echo was lost. Collect bytes as a frame too, and take a good one as the
+ * echo. Version 1 packets have no check, so they can't be told apart from
+ * pieces of a frame and are dropped until then. */
+static void sniff_frame(protocol_t *protocol, uint8_t data,
+		protocol_func_t func, void *arg) {
+    if (data == 0) {
+	if (protocol->frame_len > 0 && decode_frame(protocol) > 0) {
+	    start_framing(protocol);
+	    deliver_frame(protocol, func, arg);
+	}
+	protocol->frame_len = 0;
+	return;
+    }
+
+    if (protocol->frame_len < 0) return;
+    if (protocol->frame_len == FRAME_MAX_ENCODED) {
+	protocol->frame_len = -1;
+	return;
+    }
+    protocol->frame[protocol->frame_len++] = data;
+}
+
+static void parse_legacy(protocol_t *protocol, uint8_t data,
+		protocol_func_t func, void *arg) {
+    if (protocol->negotiating) {
+	sniff_frame(protocol, data, func, arg);
+	if (protocol->mode != PROTOCOL_LEGACY) return;
+    }
+
+    if (data == PACKET_HEADER) protocol->byte_no = 0;
+    else protocol->byte_no++;
+
+    if (protocol->byte_no == 1) {
+	protocol->instruction = data;
+    } else if (protocol->byte_no == 2) {
+	if (protocol->instruction == PROTOCOL_NEGOTIATE) {
+	    if (protocol->negotiating && data == PROTOCOL_FRAMED)
+		start_framing(protocol);
+	    return;
+	}
+	if (protocol->negotiating) return;
+	func(arg, protocol->instruction, data, 0);
+    } else if (protocol->byte_no > 2) {
+	/* Stray byte outside of a packet */
+	metrics_count(METRIC_UART_PARSE_ERRORS, 1);
+    }
+}
+
+/* now is when the data arrived */
+void protocol_parse(protocol_t *protocol, const uint8_t *data, int len,
+		int64_t now, protocol_func_t func, void *arg) {
+    int i;
+
+    if (protocol->mode == PROTOCOL_FRAMED && len > 0) {
+	if (protocol->unframed_bytes &&
+			now - protocol->last_rx >= PROTOCOL_FRAME_TIMEOUT_US) {
+	    /* A frame arrives in one burst, so a gap this long means the
+	     * partial one was noise */
+	    metrics_count(METRIC_UART_PARSE_ERRORS, 1);
+	    protocol->frame_len = 0;
+	    protocol->unframed_bytes = 0;
+	}
+	/* Bytes keep arriving, but no delimiter */
+	if (!protocol->unframed_bytes) protocol->unframed_since = now;
+	else if (now - protocol->unframed_since >= PROTOCOL_FRAME_TIMEOUT_US)
+	    fall_back(protocol);
+	protocol->last_rx = now;
+    }
+
+    for (i = 0; i < len; i++) {
+	if (protocol->mode == PROTOCOL_FRAMED)
+	    parse_framed(protocol, data[i], func, arg);
+	else
+	    parse_legacy(protocol, data[i], func, arg);
+    }
+}
+
+int protocol_encode_frame(protocol_t *protocol, int type,
+		const uint8_t *body, int len, uint8_t *out) {
+    uint8_t frame[FRAME_MAX_SIZE];
+    uint16_t crc;
+
+    if (len > FRAME_MAX_BODY) return -1;
+
+    frame[0] = (PROTOCOL_FRAMED << 4) | type;
+    frame[1] = protocol->tx_seq++;
+    frame[2] = len;
+    memcpy(frame + FRAME_HEADER_SIZE, body, len);
+    crc = crc16(frame, FRAME_HEADER_SIZE + len);
+    frame[FRAME_HEADER_SIZE + len] = crc >> 8;
+    frame[FRAME_HEADER_SIZE + len + 1] = crc & 0xff;
+
+    return cobs_encode(frame, FRAME_HEADER_SIZE + len + FRAME_CRC_SIZE, out);
+}
+
+/* out must hold FRAME_MAX_ENCODED bytes */
+int protocol_encode(protocol_t *protocol, uint8_t instruction, uint8_t value,
+		uint8_t *out) {
+    uint8_t body[2];
+
+    if (protocol_mode(protocol) == PROTOCOL_LEGACY) {
+	out[0] = PACKET_HEADER;
+	out[1] = instruction;
+	out[2] = value;
+	return PACKET_SIZE;
+    }
+
+    body[0] = instruction;
+    body[1] = value;
+    return protocol_encode_frame(protocol, FRAME_EVENTS, body, 2, out);
+}
@@ -0,0 +1,102 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+/* Version 1 is the original 3 byte packet: PACKET_HEADER, instruction,
+ * value. A value of PACKET_HEADER can't be sent.
+ *
+ * Version 2 frames are COBS encoded and terminated by a zero byte. The
+ * decoded frame is:
+ *   [version << 4 | type] [sequence] [length] [body...] [crc16 msb, lsb]
+ * with CRC-16/CCITT over everything before it. FRAME_EVENTS bodies are
+ * instruction, value pairs with the same meaning as version 1 packets.
+ * FRAME_ANALOGUE bodies are:
+ *   [first channel] [channels] [samples] [sample period / 100us]
+ * followed by samples * channels values, interleaved, oldest first.
+ *
+ * Every controller starts in version 1. We offer version 2 by sending
+ * PROTOCOL_NEGOTIATE with the version as the value. A controller which
+ * supports it echoes the packet and both sides switch to framing. The
+ * offer is always sent as a version 1 packet. A controller which is
+ * already framing answers it the same way, with a version 1 echo, so an
+ * offer whose echo was lost can be repeated.
+ *
+ * Until the echo arrives, the controller may be framing already, and
+ * pieces of its frames would parse as version 1 packets. So while we're
+ * offering, version 1 packets other than the echo are dropped, and a good
+ * frame is taken as the echo. Version 1 firmware isn't heard until the
+ * offers run out.
+ *
+ * The offer is repeated every PROTOCOL_OFFER_US until it is echoed, up to
+ * PROTOCOL_OFFER_TRIES times. A controller which resets goes back to
+ * version 1. Its packets then fail as frames, so after
+ * PROTOCOL_MAX_BAD_FRAMES bad frames in a row we go back to version 1
+ * and offer again. FRAME_MAX_ENCODED bytes without a delimiter count as a
+ * bad frame. We also go back if bytes keep arriving for
+ * PROTOCOL_FRAME_TIMEOUT_US without a delimiter, for when a slow
+ * controller takes a long time to send that many. A gap that long between
+ * bytes instead drops the partial frame, since a frame is sent in one
+ * burst. */
+#define PACKET_HEADER		0xff
+#define PACKET_SIZE		3
+
+#define PROTOCOL_LEGACY		1
+#define PROTOCOL_FRAMED		2
+#define PROTOCOL_NEGOTIATE	0x30
+#define PROTOCOL_OFFER_US	500000
+#define PROTOCOL_OFFER_TRIES	10
+#define PROTOCOL_MAX_BAD_FRAMES	4
+#define PROTOCOL_FRAME_TIMEOUT_US	200000
+
+#define FRAME_EVENTS		1
+#define FRAME_ANALOGUE		2
+
+#define FRAME_HEADER_SIZE	3
+#define FRAME_CRC_SIZE		2
+#define FRAME_MAX_BODY		255
+#define FRAME_MAX_SIZE		(FRAME_HEADER_SIZE + FRAME_MAX_BODY + \
+					FRAME_CRC_SIZE)
+/* COBS adds at most one byte in 254, plus the delimiter */
+#define FRAME_MAX_ENCODED	(FRAME_MAX_SIZE + FRAME_MAX_SIZE / 254 + 2)
+
+/* Called for each instruction, value pair received. age is how long
+ * before the end of the frame the sample was taken, in microseconds. */
+typedef void (*protocol_func_t)(void *arg, uint8_t instruction,
+		uint8_t value, int64_t age);
+
+typedef struct {
+    int mode;
+    int negotiating;
+    int offers;
+    int64_t next_offer;
+    int bad_frames;
+    int unframed_bytes;
+    int64_t unframed_since;
+    int64_t last_rx;
+
+    /* Version 1 receive state */
+    int byte_no;
+    uint8_t instruction;
+
+    /* Version 2 receive state */
+    uint8_t frame[FRAME_MAX_ENCODED];
+    int frame_len;
+    int have_seq;
+    uint8_t rx_seq;
+
+    uint8_t tx_seq;
+} protocol_t;
+
+void protocol_init(protocol_t *protocol);
+void protocol_offer(protocol_t *protocol);
+int protocol_poll(protocol_t *protocol, int64_t now);
+int protocol_mode(protocol_t *protocol);
+void protocol_parse(protocol_t *protocol, const uint8_t *data, int len,
+		int64_t now, protocol_func_t func, void *arg);
+int protocol_encode(protocol_t *protocol, uint8_t instruction, uint8_t value,
+		uint8_t *out);
+int protocol_encode_frame(protocol_t *protocol, int type,
+		const uint8_t *body, int len, uint8_t *out);
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "metrics.h"
+
+/* Measures the UART parsers, and what each version can carry over the
+ * link, to be run on the Pi. The data is parsed in reads of the same size
+ * as read_uart() in game.cpp. Usage: protocol_bench [baud] */
+
+#define BENCH_BYTES		(16 * 1024 * 1024)
+#define BENCH_READ_SIZE		64
+#define BENCH_CHANNELS		2
+#define BENCH_SAMPLES		8
+/* 8N1, so every byte costs 10 bits on the wire */
+#define BENCH_BITS_PER_BYTE	10
+
+static uint8_t bench_data[BENCH_BYTES];
+static long bench_received;
+
+static double clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void count_sample(void *arg, uint8_t instruction, uint8_t value,
+		int64_t age) {
+    bench_received++;
+}
+
+/* Returns how many bytes of samples fit, sets *samples */
+static int fill_legacy(long *samples) {
+    protocol_t protocol;
+    int len = 0;
+    long n = 0;
+
+    protocol_init(&protocol);
+    while (len + PACKET_SIZE <= BENCH_BYTES) {
+	len += protocol_encode(&protocol, 0x20 | (n % BENCH_CHANNELS),
+			n % PACKET_HEADER, bench_data + len);
+	n++;
+    }
+
+    *samples = n;
+    return len;
+}
+
+static int fill_framed(long *samples) {
+    protocol_t protocol;
+    uint8_t body[4 + BENCH_CHANNELS * BENCH_SAMPLES];
+    int len = 0;
+    long n = 0;
+    int i;
+
+    protocol_init(&protocol);
+    body[0] = 0;
+    body[1] = BENCH_CHANNELS;
+    body[2] = BENCH_SAMPLES;
+    body[3] = 200;
+    while (len + FRAME_MAX_ENCODED <= BENCH_BYTES) {
+	/* Every value, including the header and zero */
+	for (i = 0; i < BENCH_CHANNELS * BENCH_SAMPLES; i++)
+	    body[4 + i] = n + i;
+	len += protocol_encode_frame(&protocol, FRAME_ANALOGUE, body,
+			sizeof(body), bench_data + len);
+	n += BENCH_CHANNELS * BENCH_SAMPLES;
+    }
+
+    *samples = n;
+    return len;
+}
+
+static void run(const char *name, int mode, int len, long samples,
+		int baud) {
+    protocol_t protocol;
+    double start, seconds;
+    int i, n;
+
+    protocol_init(&protocol);
+    protocol.mode = mode;
+    bench_received = 0;
+
+    start = clock_ns();
+    for (i = 0; i < len; i += n) {
+	n = len - i < BENCH_READ_SIZE ? len - i : BENCH_READ_SIZE;
+	protocol_parse(&protocol, bench_data + i, n, 0, count_sample, NULL);
+    }
+    seconds = (clock_ns() - start) / 1e9;
+
+    if (bench_received != samples) {
+	printf("%s: parsed %ld samples of %ld\n", name, bench_received,
+			samples);
+	exit(1);
+    }
+
+    printf("%-10s %8.1f MB/s %8.1fM samples/s, %.2f bytes/sample, "
+		    "%.0f samples/s at %d baud\n", name,
+		    len / seconds / 1e6, samples / seconds / 1e6,
+		    (double) len / samples,
+		    (double) baud / BENCH_BITS_PER_BYTE * samples / len, baud);
+}
+
+int main(int argc, char *argv[]) {
+    int baud = argc > 1 ? atoi(argv[1]) : 115200;
+    long samples;
+    int len;
+
+    metrics_thread_init("bench");
+
+    len = fill_legacy(&samples);
+    run("version 1", PROTOCOL_LEGACY, len, samples, baud);
+
+    len = fill_framed(&samples);
+    run("version 2", PROTOCOL_FRAMED, len, samples, baud);
+
+    return 0;
+}
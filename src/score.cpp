@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "score.h"
+
+static const char *metric_names[NUM_SCORE_METRICS] = {
+    "peak", "energy", "mean", "sustained"
+};
+
+void score_config_init(score_config_t *config) {
+    const char *env;
+    int i;
+
+    config->metric = SCORE_DEFAULT_METRIC;
+    config->threshold = SCORE_DEFAULT_THRESHOLD;
+    config->window_us = SCORE_DEFAULT_WINDOW_US;
+
+    if ((env = getenv("GAME_SCORE_METRIC"))) {
+	for (i = 0; i < NUM_SCORE_METRICS; i++)
+	    if (!strcmp(env, metric_names[i]))
+		config->metric = (enum score_metric) i;
+    }
+    if ((env = getenv("GAME_SCORE_THRESHOLD")))
+	config->threshold = atoi(env);
+    if ((env = getenv("GAME_SCORE_WINDOW_MS")) && atoi(env) > 0)
+	config->window_us = (int64_t) atoi(env) * 1000;
+}
+
+const char *score_metric_name(enum score_metric metric) {
+    return metric_names[metric];
+}
+
+/* Integrate the held value up to time, clipped to the end of the window */
+static void score_advance(score_stats_t *stats, const score_config_t *config,
+		int64_t time) {
+    int64_t dt;
+
+    if (time > stats->cutoff) time = stats->cutoff;
+    if (time <= stats->last_time) return;
+
+    dt = time - stats->last_time;
+    stats->energy += (double) stats->last_value * dt / 1000000.0;
+    if (stats->last_value >= config->threshold) {
+	stats->run += dt;
+	if (stats->run > stats->sustained) stats->sustained = stats->run;
+    } else stats->run = 0;
+
+    stats->last_time = time;
+}
+
+void score_reset(score_stats_t *stats, const score_config_t *config,
+		int64_t start, int value) {
+    memset(stats, 0, sizeof(score_stats_t));
+    stats->start = start;
+    stats->cutoff = start + config->window_us;
+    stats->last_time = start;
+    stats->last_value = value;
+    stats->peak = value;
+    stats->active = 1;
+}
+
+void score_update(score_stats_t *stats, const score_config_t *config,
+		int64_t time, int value) {
+    if (!stats->active) return;
+
+    /* Samples from before the window are the value held at the start */
+    if (time < stats->start) time = stats->start;
+    score_advance(stats, config, time);
+    if (time >= stats->cutoff) return;
+
+    stats->last_value = value;
+    if (value > stats->peak) stats->peak = value;
+    stats->samples++;
+}
+
+void score_finish(score_stats_t *stats, const score_config_t *config) {
+    if (!stats->active) return;
+    score_advance(stats, config, stats->cutoff);
+    stats->active = 0;
+}
+
+double score_value(const score_stats_t *stats, enum score_metric metric) {
+    int64_t elapsed = stats->last_time - stats->start;
+
+    switch (metric) {
+	case SCORE_METRIC_PEAK:
+	    return stats->peak;
+	case SCORE_METRIC_ENERGY:
+	    return stats->energy;
+	case SCORE_METRIC_MEAN:
+	    if (elapsed <= 0) return stats->last_value;
+	    return stats->energy * 1000000.0 / elapsed;
+	case SCORE_METRIC_SUSTAINED:
+	    return stats->sustained / 1000000.0;
+	default:
+	    break;
+    }
+    return 0;
+}
+
+int score_format(const score_stats_t *stats, char *buf, int len) {
+    return snprintf(buf, len,
+		    "peak %d mean %.1f energy %.1f sustained %.2fs samples %u",
+		    stats->peak,
+		    score_value(stats, SCORE_METRIC_MEAN),
+		    stats->energy,
+		    score_value(stats, SCORE_METRIC_SUSTAINED),
+		    stats->samples);
+}
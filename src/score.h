@@ -0,0 +1,50 @@
+#ifndef SCORE_H
+#define SCORE_H
+
+#include <stdint.h>
+
+/* Statistics which may be used to decide the winner of a game */
+enum score_metric {
+    SCORE_METRIC_PEAK, SCORE_METRIC_ENERGY, SCORE_METRIC_MEAN,
+    SCORE_METRIC_SUSTAINED,
+    NUM_SCORE_METRICS
+};
+
+#define SCORE_DEFAULT_METRIC	SCORE_METRIC_ENERGY
+#define SCORE_DEFAULT_THRESHOLD	70
+#define SCORE_DEFAULT_WINDOW_US	7000000
+
+typedef struct {
+    enum score_metric metric;
+    int threshold;
+    int64_t window_us;
+} score_config_t;
+
+/* Running statistics for one controller over one game window. All times
+ * are in microseconds on the game clock, the value is held between
+ * samples. */
+typedef struct {
+    int64_t start;
+    int64_t cutoff;
+    int64_t last_time;
+    int last_value;
+    int active;
+
+    int peak;
+    uint32_t samples;
+    double energy;
+    int64_t run;
+    int64_t sustained;
+} score_stats_t;
+
+void score_config_init(score_config_t *config);
+void score_reset(score_stats_t *stats, const score_config_t *config,
+		int64_t start, int value);
+void score_update(score_stats_t *stats, const score_config_t *config,
+		int64_t time, int value);
+void score_finish(score_stats_t *stats, const score_config_t *config);
+double score_value(const score_stats_t *stats, enum score_metric metric);
+const char *score_metric_name(enum score_metric metric);
+int score_format(const score_stats_t *stats, char *buf, int len);
+
+#endif
@@ -0,0 +1,252 @@
+#ifdef SFX_CHECK
+#include "sfx_check.h"
+#else
+#include <alsa/asoundlib.h>
+#endif
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "sfx.h"
+#include "metrics.h"
+
+#define SFX_MAX_VOICES	8
+#define SFX_MAX_PERIOD	4096
+/* Must be a power of two */
+#define SFX_QUEUE_SIZE	16
+
+typedef struct {
+    int16_t *data;
+    int frames;
+} sfx_clip_t;
+
+typedef struct {
+    enum sfx_clip clip;
+    int64_t time;
+} sfx_event_t;
+
+/* Owned by the mixer thread */
+typedef struct {
+    const sfx_clip_t *clip;
+    int pos;
+    int64_t time;
+} sfx_voice_t;
+
+static const char *clip_names[NUM_SFX_CLIPS] = {
+    "start.raw", "power_l.raw", "power_r.raw"
+};
+
+static sfx_clip_t sfx_clips[NUM_SFX_CLIPS];
+static sfx_voice_t sfx_voices[SFX_MAX_VOICES];
+static int16_t sfx_period[SFX_MAX_PERIOD * SFX_CHANNELS]
+			__attribute__((aligned(16)));
+static snd_pcm_t *sfx_pcm;
+static snd_pcm_uframes_t sfx_period_frames;
+static int sfx_enabled;
+
+/* Single producer, single consumer queue of triggers */
+static sfx_event_t sfx_queue[SFX_QUEUE_SIZE];
+static unsigned int sfx_queue_head, sfx_queue_tail;
+
+static int64_t sfx_clock_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sfx_trigger(enum sfx_clip clip, int64_t time) {
+    unsigned int head;
+
+    if (!sfx_enabled || !sfx_clips[clip].data) return;
+
+    head = __atomic_load_n(&sfx_queue_head, __ATOMIC_RELAXED);
+    if (head - __atomic_load_n(&sfx_queue_tail, __ATOMIC_ACQUIRE) >=
+		    SFX_QUEUE_SIZE) return;
+
+    sfx_queue[head & (SFX_QUEUE_SIZE - 1)].clip = clip;
+    sfx_queue[head & (SFX_QUEUE_SIZE - 1)].time = time;
+    __atomic_store_n(&sfx_queue_head, head + 1, __ATOMIC_RELEASE);
+    metrics_count(METRIC_SFX_TRIGGERS, 1);
+}
+
+/* Saturating add of in to out, n samples. n must be even. */
+static void mix_samples(int16_t *out, const int16_t *in, int n) {
+    int i;
+#if defined(__ARM_NEON__)
+    for (i = 0; i + 8 <= n; i += 8)
+	vst1q_s16(out + i, vqaddq_s16(vld1q_s16(out + i), vld1q_s16(in + i)));
+#elif defined(__ARM_ARCH_6ZK__) || defined(__ARM_ARCH_6KZ__) || \
+	defined(__ARM_FEATURE_SIMD32)
+    /* Two samples at a time with the ARMv6 SIMD instructions */
+    typedef uint32_t __attribute__((may_alias)) pair_t;
+    pair_t *o = (pair_t *) out;
+    const pair_t *s = (const pair_t *) in;
+    uint32_t res;
+
+    for (i = 0; i + 2 <= n; i += 2) {
+	__asm__ ("qadd16 %0, %1, %2" : "=r" (res) : "r" (*o), "r" (*s));
+	*o++ = res;
+	s++;
+    }
+#else
+    i = 0;
+#endif
+    /* Generic tail, or the whole buffer left to the auto-vectoriser */
+    for (; i < n; i++) {
+	int32_t sum = out[i] + in[i];
+	if (sum > INT16_MAX) sum = INT16_MAX;
+	if (sum < INT16_MIN) sum = INT16_MIN;
+	out[i] = sum;
+    }
+}
+
+static void start_voices(void) {
+    unsigned int tail = __atomic_load_n(&sfx_queue_tail, __ATOMIC_RELAXED);
+    unsigned int head = __atomic_load_n(&sfx_queue_head, __ATOMIC_ACQUIRE);
+    sfx_event_t *event;
+    int i, oldest;
+
+    for (; tail != head; tail++) {
+	event = &sfx_queue[tail & (SFX_QUEUE_SIZE - 1)];
+
+	/* Take a free voice, or steal the one that has played longest */
+	oldest = 0;
+	for (i = 0; i < SFX_MAX_VOICES; i++) {
+	    if (!sfx_voices[i].clip) break;
+	    if (sfx_voices[i].pos > sfx_voices[oldest].pos) oldest = i;
+	}
+	if (i == SFX_MAX_VOICES) i = oldest;
+
+	sfx_voices[i].clip = &sfx_clips[event->clip];
+	sfx_voices[i].pos = 0;
+	sfx_voices[i].time = event->time;
+    }
+
+    __atomic_store_n(&sfx_queue_tail, tail, __ATOMIC_RELEASE);
+}
+
+/* Returns the time until the first new sample is heard */
+static int64_t output_delay_us(void) {
+    snd_pcm_sframes_t delay;
+
+    if (snd_pcm_delay(sfx_pcm, &delay) < 0 || delay < 0) delay = 0;
+    return (int64_t) delay * 1000000 / SFX_RATE;
+}
+
+static void mix_period(void) {
+    int i, frames;
+    int64_t now = 0;
+    sfx_voice_t *voice;
+
+    memset(sfx_period, 0, sfx_period_frames * SFX_CHANNELS * sizeof(int16_t));
+
+    for (i = 0; i < SFX_MAX_VOICES; i++) {
+	voice = &sfx_voices[i];
+	if (!voice->clip) continue;
+
+	if (voice->pos == 0) {
+	    if (!now) now = sfx_clock_us() + output_delay_us();
+	    metrics_observe(METRIC_SFX_LATENCY, now - voice->time);
+	}
+
+	frames = voice->clip->frames - voice->pos;
+	if (frames > (int) sfx_period_frames) frames = sfx_period_frames;
+	mix_samples(sfx_period, voice->clip->data + voice->pos * SFX_CHANNELS,
+			frames * SFX_CHANNELS);
+
+	voice->pos += frames;
+	if (voice->pos >= voice->clip->frames) voice->clip = NULL;
+    }
+}
+
+static void *sfx_func(void *p) {
+    snd_pcm_sframes_t ret;
+
+    metrics_thread_init("sfx");
+
+    /* Always write a period, so that the buffer stays at its minimum
+     * fill and new voices are heard as soon as possible */
+    while (1) {
+	start_voices();
+	mix_period();
+
+	ret = snd_pcm_writei(sfx_pcm, sfx_period, sfx_period_frames);
+	if (ret < 0) {
+	    if (ret == -EPIPE) metrics_count(METRIC_SFX_UNDERRUNS, 1);
+	    if (snd_pcm_recover(sfx_pcm, ret, 1) < 0) {
+		printf("sfx: %s\n", snd_strerror(ret));
+		usleep(SFX_LATENCY_US);
+	    }
+	}
+    }
+
+    return NULL;
+}
+
+static int load_clip(const char *dir, int index) {
+    char filename[256];
+    FILE *fp;
+    long size;
+
+    snprintf(filename, sizeof(filename), "%s%s", dir, clip_names[index]);
+    if (!(fp = fopen(filename, "r"))) return -1;
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (size < (long) (SFX_CHANNELS * sizeof(int16_t))) {
+	fclose(fp);
+	return -1;
+    }
+
+    sfx_clips[index].frames = size / (SFX_CHANNELS * sizeof(int16_t));
+    sfx_clips[index].data = (int16_t *) malloc(size);
+    assert(sfx_clips[index].data);
+    fread(sfx_clips[index].data, 1, size, fp);
+
+    fclose(fp);
+    return 0;
+}
+
+/* GAME_SFX_DEVICE may name any ALSA PCM, eg. "null" or
+ * "file:'/tmp/sfx.raw',raw" to run without sound hardware. */
+int sfx_init(void) {
+    int i, err;
+    const char *device, *dir;
+    snd_pcm_uframes_t buffer_frames;
+    pthread_t sfx_thread;
+
+    if (!(device = getenv("GAME_SFX_DEVICE"))) device = SFX_DEVICE;
+    if (!(dir = getenv("GAME_SFX_PATH"))) dir = SFX_PATH;
+
+    for (i = 0; i < NUM_SFX_CLIPS; i++) {
+	if (load_clip(dir, i) < 0)
+	    printf("sfx: couldn't load %s%s\n", dir, clip_names[i]);
+    }
+
+    if ((err = snd_pcm_open(&sfx_pcm, device,
+				    SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+	printf("sfx: %s: %s\n", device, snd_strerror(err));
+	return -1;
+    }
+
+    if ((err = snd_pcm_set_params(sfx_pcm, SND_PCM_FORMAT_S16_LE,
+				    SND_PCM_ACCESS_RW_INTERLEAVED,
+				    SFX_CHANNELS, SFX_RATE, 1,
+				    SFX_LATENCY_US)) < 0 ||
+		    (err = snd_pcm_get_params(sfx_pcm, &buffer_frames,
+				    &sfx_period_frames)) < 0) {
+	printf("sfx: %s\n", snd_strerror(err));
+	snd_pcm_close(sfx_pcm);
+	return -1;
+    }
+    if (sfx_period_frames > SFX_MAX_PERIOD) sfx_period_frames = SFX_MAX_PERIOD;
+
+    sfx_enabled = 1;
+    pthread_create(&sfx_thread, NULL, sfx_func, NULL);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef SFX_H
+#define SFX_H
+
+#include <stdint.h>
+
+/* Clips are raw signed 16 bit little endian stereo at SFX_RATE */
+#define SFX_DEVICE	"default"
+#define SFX_PATH	"/home/pi/sfx/"
+#define SFX_RATE	48000
+#define SFX_CHANNELS	2
+/* Requested ALSA buffer length, periods are a quarter of this */
+#define SFX_LATENCY_US	10000
+
+enum sfx_clip {
+    SFX_START, SFX_POWER_L, SFX_POWER_R,
+    NUM_SFX_CLIPS
+};
+
+int sfx_init(void);
+/* May only be called from one thread. time is when the triggering event
+ * happened, on the CLOCK_MONOTONIC microsecond clock. */
+void sfx_trigger(enum sfx_clip clip, int64_t time);
+
+#endif
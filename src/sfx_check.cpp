@@ -0,0 +1,450 @@
+#include <pthread.h>
+#include <time.h>
+
+#include "sfx_check.h"
+#include "sfx.h"
+#include "metrics.h"
+
+/* Runs the mixer thread from sfx.cpp against a model sound card, which
+ * plays at SFX_RATE from a buffer of four periods and keeps everything
+ * written to it. Then:
+ *  1. Triggers clips from inside the card at fixed periods, so that each
+ *     voice starts on a known frame, and compares the output with a
+ *     reference mix. This covers saturation in both directions and voice
+ *     stealing.
+ *  2. Triggers clips from this thread at random times and finds each one
+ *     in the output, which gives the trigger to sound latency.
+ * GAME_SFX_CHECK_OUT names a file to save the output in, raw S16LE stereo.
+ * Build with SIM_CXX set to an ARM compiler to run the qadd16 or NEON
+ * mix. */
+
+#define CHECK_PERIOD_FRAMES	(SFX_RATE / 4 * SFX_LATENCY_US / 1000000)
+#define CHECK_BUFFER_PERIODS	4
+#define CHECK_MAX_FRAMES	(SFX_RATE * 10)
+#define CHECK_MAX_RUNS		256
+/* SFX_MAX_VOICES in sfx.cpp */
+#define CHECK_VOICES		8
+
+#define CHECK_SHORT_FRAMES	1000
+#define CHECK_LONG_FRAMES	4000
+#define CHECK_MIX_PERIODS	100
+#define CHECK_TRIGGERS		100
+#define CHECK_SPACING_MIN_US	40000
+#define CHECK_SPACING_RANGE_US	20000
+
+typedef struct {
+    int period;
+    enum sfx_clip clip;
+    int count;
+} check_event_t;
+
+/* start.raw is positive, power_l.raw negative and power_r.raw is long */
+static const check_event_t check_events[] = {
+    { 2, SFX_START, 1 }, { 2, SFX_POWER_L, 1 },	/* plain add */
+    { 20, SFX_START, 3 },			/* saturates high */
+    { 40, SFX_POWER_L, 3 },			/* saturates low */
+    { 60, SFX_POWER_R, CHECK_VOICES },		/* every voice busy */
+    { 65, SFX_START, 1 },			/* steals the oldest */
+};
+
+#define NUM_CHECK_EVENTS (sizeof(check_events) / sizeof(check_events[0]))
+
+static const char *check_clip_names[NUM_SFX_CLIPS] = {
+    "start.raw", "power_l.raw", "power_r.raw"
+};
+
+static int16_t *check_clips[NUM_SFX_CLIPS];
+static int check_clip_frames[NUM_SFX_CLIPS];
+
+/* Playback starts when the buffer is full and stops if it runs dry.
+ * Frame base of each run was heard at time t0. */
+typedef struct {
+    int64_t base;
+    int64_t t0;
+} check_run_t;
+
+/* The model card, only touched with check_lock held */
+struct sfx_check_pcm {
+    int period_frames;
+    int buffer_frames;
+    int running;
+    int64_t queue_start;
+    check_run_t runs[CHECK_MAX_RUNS];
+    int num_runs;
+    int64_t written;
+    int underruns;
+};
+
+static struct sfx_check_pcm check_pcm;
+static pthread_mutex_t check_lock = PTHREAD_MUTEX_INITIALIZER;
+static int16_t check_out[CHECK_MAX_FRAMES * SFX_CHANNELS];
+static int check_schedule = 1;
+
+static int64_t check_clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Frames heard so far, called with check_lock held */
+static int64_t check_played(int64_t now) {
+    check_run_t *run = &check_pcm.runs[check_pcm.num_runs - 1];
+
+    if (!check_pcm.running) return check_pcm.queue_start;
+    return run->base + (now - run->t0) * SFX_RATE / 1000000000;
+}
+
+/* The frame being heard at time, or -1 if nothing was playing yet */
+static int64_t check_time_frame(int64_t time) {
+    int i;
+
+    for (i = check_pcm.num_runs - 1; i >= 0; i--)
+	if (check_pcm.runs[i].t0 <= time)
+	    return check_pcm.runs[i].base +
+		    (time - check_pcm.runs[i].t0) * SFX_RATE / 1000000000;
+    return -1;
+}
+
+static int64_t check_frame_time(int64_t frame) {
+    int i;
+
+    for (i = check_pcm.num_runs - 1; i > 0; i--)
+	if (check_pcm.runs[i].base <= frame) break;
+    return check_pcm.runs[i].t0 +
+	    (frame - check_pcm.runs[i].base) * 1000000000 / SFX_RATE;
+}
+
+int snd_pcm_open(snd_pcm_t **pcm, const char *name, snd_pcm_stream_t stream,
+		int mode) {
+    *pcm = &check_pcm;
+    return 0;
+}
+
+int snd_pcm_set_params(snd_pcm_t *pcm, snd_pcm_format_t format,
+		snd_pcm_access_t access, unsigned int channels,
+		unsigned int rate, int soft_resample, unsigned int latency) {
+    if (channels != SFX_CHANNELS || rate != SFX_RATE) return -EINVAL;
+    pcm->period_frames = CHECK_PERIOD_FRAMES;
+    pcm->buffer_frames = pcm->period_frames * CHECK_BUFFER_PERIODS;
+    return 0;
+}
+
+int snd_pcm_get_params(snd_pcm_t *pcm, snd_pcm_uframes_t *buffer_size,
+		snd_pcm_uframes_t *period_size) {
+    *buffer_size = pcm->buffer_frames;
+    *period_size = pcm->period_frames;
+    return 0;
+}
+
+int snd_pcm_close(snd_pcm_t *pcm) {
+    return 0;
+}
+
+/* Phase 1 triggers go from the mixer thread, just before it mixes the
+ * period they are for */
+static void check_trigger_period(int period) {
+    unsigned int i;
+    int n;
+
+    if (!__atomic_load_n(&check_schedule, __ATOMIC_ACQUIRE)) return;
+    for (i = 0; i < NUM_CHECK_EVENTS; i++) {
+	if (check_events[i].period != period) continue;
+	for (n = 0; n < check_events[i].count; n++)
+	    sfx_trigger(check_events[i].clip, check_clock_ns() / 1000);
+    }
+    if (period == CHECK_MIX_PERIODS)
+	__atomic_store_n(&check_schedule, 0, __ATOMIC_RELEASE);
+}
+
+/* Blocks until there's room, like a real card */
+snd_pcm_sframes_t snd_pcm_writei(snd_pcm_t *pcm, const void *buffer,
+		snd_pcm_uframes_t size) {
+    int64_t now, queued;
+    struct timespec ts;
+
+    pthread_mutex_lock(&check_lock);
+    while (1) {
+	now = check_clock_ns();
+	if (check_played(now) > pcm->written) {
+	    pcm->running = 0;
+	    pcm->underruns++;
+	    pthread_mutex_unlock(&check_lock);
+	    return -EPIPE;
+	}
+	queued = pcm->written - check_played(now);
+	if (queued + (int64_t) size <= pcm->buffer_frames) break;
+
+	pthread_mutex_unlock(&check_lock);
+	ts.tv_sec = 0;
+	ts.tv_nsec = (queued + size - pcm->buffer_frames) * 1000000000 /
+		SFX_RATE;
+	nanosleep(&ts, NULL);
+	pthread_mutex_lock(&check_lock);
+    }
+
+    if (pcm->written + (int64_t) size <= CHECK_MAX_FRAMES)
+	memcpy(check_out + pcm->written * SFX_CHANNELS, buffer,
+			size * SFX_CHANNELS * sizeof(int16_t));
+    pcm->written += size;
+
+    /* Starts once the buffer is full */
+    if (!pcm->running &&
+		    pcm->written - pcm->queue_start >= pcm->buffer_frames &&
+		    pcm->num_runs < CHECK_MAX_RUNS) {
+	pcm->running = 1;
+	pcm->runs[pcm->num_runs].t0 = now;
+	pcm->runs[pcm->num_runs].base = pcm->queue_start;
+	pcm->num_runs++;
+    }
+    pthread_mutex_unlock(&check_lock);
+
+    check_trigger_period(pcm->written / pcm->period_frames);
+    return size;
+}
+
+int snd_pcm_recover(snd_pcm_t *pcm, int err, int silent) {
+    if (err != -EPIPE) return err;
+
+    pthread_mutex_lock(&check_lock);
+    pcm->queue_start = pcm->written;
+    pthread_mutex_unlock(&check_lock);
+    return 0;
+}
+
+int snd_pcm_delay(snd_pcm_t *pcm, snd_pcm_sframes_t *delay) {
+    pthread_mutex_lock(&check_lock);
+    *delay = pcm->written - check_played(check_clock_ns());
+    pthread_mutex_unlock(&check_lock);
+    return 0;
+}
+
+const char *snd_strerror(int errnum) {
+    return strerror(-errnum);
+}
+
+static int16_t check_sample(int clip, int frame, int channel) {
+    switch (clip) {
+	case SFX_START:
+	    return (1000 + 19 * frame) / (channel + 1);
+	case SFX_POWER_L:
+	    return channel ? -12000 - (frame % 7) * 100 : -15000;
+	default:
+	    return channel ? 2000 - frame % 500 : 500 + frame % 1000;
+    }
+}
+
+static int write_clips(const char *dir) {
+    int c, f, ch;
+    char filename[256];
+    FILE *fp;
+
+    for (c = 0; c < NUM_SFX_CLIPS; c++) {
+	check_clip_frames[c] = c == SFX_POWER_R ?
+		CHECK_LONG_FRAMES : CHECK_SHORT_FRAMES;
+	check_clips[c] = (int16_t *) malloc(check_clip_frames[c] *
+			SFX_CHANNELS * sizeof(int16_t));
+	assert(check_clips[c]);
+	for (f = 0; f < check_clip_frames[c]; f++)
+	    for (ch = 0; ch < SFX_CHANNELS; ch++)
+		check_clips[c][f * SFX_CHANNELS + ch] = check_sample(c, f, ch);
+
+	snprintf(filename, sizeof(filename), "%s/%s", dir,
+			check_clip_names[c]);
+	if (!(fp = fopen(filename, "w"))) return -1;
+	fwrite(check_clips[c], sizeof(int16_t),
+			check_clip_frames[c] * SFX_CHANNELS, fp);
+	fclose(fp);
+    }
+    return 0;
+}
+
+/* Every overlap in check_events has samples of one sign, or only two
+ * voices, so the order the mixer adds them in doesn't matter */
+static void reference_mix(int32_t *ref, int frames) {
+    int start[NUM_CHECK_EVENTS * CHECK_VOICES];
+    int end[NUM_CHECK_EVENTS * CHECK_VOICES];
+    int clip[NUM_CHECK_EVENTS * CHECK_VOICES];
+    int num_voices = 0;
+    unsigned int i;
+    int v, n, f, active, oldest;
+
+    for (i = 0; i < NUM_CHECK_EVENTS; i++) {
+	for (n = 0; n < check_events[i].count; n++) {
+	    f = check_events[i].period * CHECK_PERIOD_FRAMES;
+
+	    /* Stop the one which has played longest if they're all busy */
+	    active = 0;
+	    oldest = -1;
+	    for (v = 0; v < num_voices; v++) {
+		if (end[v] <= f) continue;
+		active++;
+		if (oldest < 0 || start[v] < start[oldest]) oldest = v;
+	    }
+	    if (active == CHECK_VOICES) end[oldest] = f;
+
+	    start[num_voices] = f;
+	    clip[num_voices] = check_events[i].clip;
+	    end[num_voices] = f + check_clip_frames[clip[num_voices]];
+	    num_voices++;
+	}
+    }
+
+    memset(ref, 0, frames * SFX_CHANNELS * sizeof(int32_t));
+    for (v = 0; v < num_voices; v++)
+	for (f = start[v]; f < end[v] && f < frames; f++)
+	    for (n = 0; n < SFX_CHANNELS; n++)
+		ref[f * SFX_CHANNELS + n] +=
+			check_clips[clip[v]][(f - start[v]) * SFX_CHANNELS + n];
+
+    for (i = 0; i < (unsigned int) frames * SFX_CHANNELS; i++) {
+	if (ref[i] > INT16_MAX) ref[i] = INT16_MAX;
+	if (ref[i] < INT16_MIN) ref[i] = INT16_MIN;
+    }
+}
+
+static int check_mix(void) {
+    int frames = CHECK_MIX_PERIODS * CHECK_PERIOD_FRAMES;
+    static int32_t ref[CHECK_MIX_PERIODS * CHECK_PERIOD_FRAMES *
+			SFX_CHANNELS];
+    int i;
+
+    reference_mix(ref, frames);
+    for (i = 0; i < frames * SFX_CHANNELS; i++) {
+	if (check_out[i] != ref[i]) {
+	    printf("sfx_check: mix differs at frame %d channel %d, "
+			    "got %d expected %d\n", i / SFX_CHANNELS,
+			    i % SFX_CHANNELS, check_out[i], ref[i]);
+	    return -1;
+	}
+    }
+    printf("sfx_check: %d frames match the reference mix\n", frames);
+    return 0;
+}
+
+static int64_t check_written(int *underruns) {
+    int64_t written;
+
+    pthread_mutex_lock(&check_lock);
+    written = check_pcm.written;
+    *underruns = check_pcm.underruns;
+    pthread_mutex_unlock(&check_lock);
+    return written;
+}
+
+/* The histogram sfx.cpp keeps for itself */
+static void sfx_reported(int64_t *sum, uint64_t *count) {
+    static char buf[16384];
+    const char *p;
+    long long s = 0;
+    unsigned long long c = 0;
+
+    metrics_format(buf, sizeof(buf));
+    if ((p = strstr(buf, "game_sfx_latency_us_sum ")))
+	sscanf(p, "game_sfx_latency_us_sum %lld", &s);
+    if ((p = strstr(buf, "game_sfx_latency_us_count ")))
+	sscanf(p, "game_sfx_latency_us_count %llu", &c);
+    *sum = s;
+    *count = c;
+}
+
+static int check_latency(void) {
+    static int64_t times[CHECK_TRIGGERS];
+    unsigned int seed = 1;
+    int i, found = 0;
+    int64_t f, frame, latency, min = -1, max = 0, total = 0;
+    int64_t sum_before, sum_after;
+    uint64_t count_before, count_after;
+    int underruns;
+
+    sfx_reported(&sum_before, &count_before);
+    pthread_mutex_lock(&check_lock);
+    underruns = check_pcm.underruns;
+    pthread_mutex_unlock(&check_lock);
+
+    for (i = 0; i < CHECK_TRIGGERS; i++) {
+	usleep(CHECK_SPACING_MIN_US + rand_r(&seed) % CHECK_SPACING_RANGE_US);
+	times[i] = check_clock_ns();
+	sfx_trigger(SFX_START, times[i] / 1000);
+    }
+    usleep(CHECK_SPACING_MIN_US);
+
+    /* Each clip starts with a non-zero sample after silence */
+    pthread_mutex_lock(&check_lock);
+    for (i = 0; i < CHECK_TRIGGERS; i++) {
+	if ((frame = check_time_frame(times[i])) < 0) continue;
+	for (f = frame; f < check_pcm.written && f < CHECK_MAX_FRAMES; f++)
+	    if (check_out[f * SFX_CHANNELS]) break;
+	if (f >= check_pcm.written || f >= CHECK_MAX_FRAMES) continue;
+
+	latency = (check_frame_time(f) - times[i]) / 1000;
+	if (min < 0 || latency < min) min = latency;
+	if (latency > max) max = latency;
+	total += latency;
+	found++;
+    }
+    underruns = check_pcm.underruns - underruns;
+    pthread_mutex_unlock(&check_lock);
+
+    sfx_reported(&sum_after, &count_after);
+    if (underruns)
+	printf("sfx_check: %d underruns while measuring latency\n",
+			underruns);
+    if (!found || (found != CHECK_TRIGGERS && !underruns)) {
+	printf("sfx_check: only heard %d of %d triggers\n", found,
+			CHECK_TRIGGERS);
+	return -1;
+    }
+
+    printf("sfx_check: trigger to sound %lld/%lld/%lld us min/mean/max "
+		    "over %d triggers\n", (long long) min,
+		    (long long) (total / found), (long long) max, found);
+    if (count_after > count_before)
+	printf("sfx_check: sfx reports a mean of %lld us\n",
+			(long long) ((sum_after - sum_before) /
+				(int64_t) (count_after - count_before)));
+    return 0;
+}
+
+int main(void) {
+    char dir[] = "/tmp/sfx_check.XXXXXX";
+    char path[64];
+    const char *out;
+    FILE *fp;
+    int ret = 0;
+    int underruns;
+
+    if (!mkdtemp(dir) || write_clips(dir) < 0) {
+	printf("sfx_check: couldn't write clips to %s\n", dir);
+	return 1;
+    }
+    snprintf(path, sizeof(path), "%s/", dir);
+    setenv("GAME_SFX_PATH", path, 1);
+
+    metrics_thread_init("check");
+    if (sfx_init() < 0) return 1;
+
+    /* Phase 1 runs itself, wait for it to finish */
+    while (__atomic_load_n(&check_schedule, __ATOMIC_ACQUIRE) ||
+		    check_written(&underruns) <
+			    (CHECK_MIX_PERIODS + 1) * CHECK_PERIOD_FRAMES)
+	usleep(1000);
+    if (underruns) {
+	printf("sfx_check: %d underruns, the mix can't be compared\n",
+			underruns);
+	ret = 1;
+    } else if (check_mix() < 0) ret = 1;
+
+    if (check_latency() < 0) ret = 1;
+
+    if ((out = getenv("GAME_SFX_CHECK_OUT")) && (fp = fopen(out, "w"))) {
+	pthread_mutex_lock(&check_lock);
+	fwrite(check_out, sizeof(int16_t), SFX_CHANNELS *
+			(check_pcm.written < CHECK_MAX_FRAMES ?
+			 check_pcm.written : CHECK_MAX_FRAMES), fp);
+	pthread_mutex_unlock(&check_lock);
+	fclose(fp);
+    }
+
+    return ret;
+}
@@ -0,0 +1,38 @@
+#ifndef SFX_CHECK_H
+#define SFX_CHECK_H
+
+/* Stand-in for the ALSA PCM, so that sfx.cpp built with -DSFX_CHECK plays
+ * into a model sound card which records everything written to it. See
+ * sfx_check.cpp. */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct sfx_check_pcm snd_pcm_t;
+typedef long snd_pcm_sframes_t;
+typedef unsigned long snd_pcm_uframes_t;
+
+typedef enum { SND_PCM_STREAM_PLAYBACK = 0 } snd_pcm_stream_t;
+typedef enum { SND_PCM_FORMAT_S16_LE = 2 } snd_pcm_format_t;
+typedef enum { SND_PCM_ACCESS_RW_INTERLEAVED = 3 } snd_pcm_access_t;
+
+int snd_pcm_open(snd_pcm_t **pcm, const char *name, snd_pcm_stream_t stream,
+		int mode);
+int snd_pcm_set_params(snd_pcm_t *pcm, snd_pcm_format_t format,
+		snd_pcm_access_t access, unsigned int channels,
+		unsigned int rate, int soft_resample, unsigned int latency);
+int snd_pcm_get_params(snd_pcm_t *pcm, snd_pcm_uframes_t *buffer_size,
+		snd_pcm_uframes_t *period_size);
+int snd_pcm_close(snd_pcm_t *pcm);
+snd_pcm_sframes_t snd_pcm_writei(snd_pcm_t *pcm, const void *buffer,
+		snd_pcm_uframes_t size);
+int snd_pcm_recover(snd_pcm_t *pcm, int err, int silent);
+int snd_pcm_delay(snd_pcm_t *pcm, snd_pcm_sframes_t *delay);
+const char *snd_strerror(int errnum);
+
+#endif
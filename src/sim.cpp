@@ -0,0 +1,700 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "sim.h"
+#include "omxplayer.h"
+#include "protocol.h"
+#include "sfx.h"
+
+/* Options are taken from the environment:
+ *   GAME_SIM_GAMES	 stop after this many games (1000)
+ *   GAME_SIM_SEED	 seed for the controller and the scheduler (1)
+ *   GAME_SIM_SCRIPT	 replay "<ms> <instruction in hex> <value>" lines,
+ *			 looping, instead of generating input
+ *   GAME_SIM_FRAMED	 the controller accepts protocol version 2
+ *   GAME_SIM_RESET_S	 the controller resets to version 1 this often
+ *   GAME_SIM_LOSE_ECHO	 every other echo of an offer is lost
+ *   GAME_SIM_MASH	 press start at any time, not just in attract mode
+ *   GAME_SIM_SHUFFLE	 run ready threads in a random order
+ *   GAME_SIM_JITTER_US	 add up to this much to every sleep
+ *   GAME_SIM_TICK_MS	 controller sample period (20)
+ *   GAME_SIM_STREAMS	 stream lengths in seconds (20,5,12,8,8)
+ *   GAME_SIM_QUIET	 don't print the transcript, only its hash
+ *
+ * Every packet which reaches the game must be one the controller sent, in
+ * order, although some may be dropped. Anything else, such as frame bytes
+ * read as version 1 packets, ends the run. */
+
+#define SIM_MAX_THREADS		8
+#define SIM_STACK_SIZE		(256 * 1024)
+#define SIM_VSYNC_US		16667
+#define SIM_PLAYER_TICK_US	40000
+/* Give up if no game finishes in this much virtual time */
+#define SIM_WATCHDOG_US		(600 * 1000000LL)
+
+#define SIM_PRESS_MIN_US	500000
+#define SIM_PRESS_RANGE_US	2500000
+#define SIM_FRAME_SAMPLES	4
+#define SIM_MAX_SCRIPT		4096
+#define SIM_SENT_LOG		4096
+
+#define NUM_SIM_STREAMS		5
+#define SIM_ATTRACT_STREAM	0
+#define SIM_GAME_STREAM		2
+#define SIM_WINNER_STREAM	3
+
+enum sim_state {
+    SIM_RUNNABLE, SIM_SLEEPING, SIM_WAITING, SIM_DONE
+};
+
+/* ucontext only starts a thread, after that we switch with _setjmp and
+ * _longjmp, which don't make a system call to save the signal mask */
+typedef struct {
+    ucontext_t context;
+    jmp_buf jmp;
+    int started;
+    void *(*func)(void *);
+    void *arg;
+    enum sim_state state;
+    int64_t wake;
+    pthread_cond_t *cond;
+    uint64_t wait_order;
+} sim_thread_t;
+
+typedef struct {
+    int64_t time;
+    uint8_t instruction;
+    uint8_t value;
+} sim_event_t;
+
+static struct {
+    int games;
+    uint32_t seed;
+    const char *script;
+    int framed;
+    int64_t reset_us;
+    int lose_echo;
+    int mash;
+    int shuffle;
+    int jitter_us;
+    int tick_us;
+    int64_t streams[NUM_SIM_STREAMS];
+    int quiet;
+} sim_options = {
+    1000, 1, NULL, 0, 0, 0, 0, 0, 0, 20000,
+    { 20000000, 5000000, 12000000, 8000000, 8000000 }, 0
+};
+
+/* Scheduler */
+static sim_thread_t sim_threads[SIM_MAX_THREADS];
+static int sim_num_threads;
+static sim_thread_t *sim_current;
+static ucontext_t sim_scheduler;
+static jmp_buf sim_scheduler_jmp;
+static int64_t sim_now;
+static uint64_t sim_wait_count;
+static uint64_t sim_switches;
+static uint32_t sim_sched_rand;
+static int sim_finished;
+
+/* Transcript */
+static uint64_t sim_hash = 0xcbf29ce484222325ULL;
+
+/* Player */
+static OMXPlayerInterface sim_interface;
+static OMXReader sim_reader;
+static int (*sim_control)(OMXReader *reader);
+static int (*sim_loop)(OMXReader *reader);
+static unsigned int sim_stream;
+static int sim_games;
+static int sim_wins[2];
+static int64_t sim_last_game;
+
+/* Controller */
+static protocol_t ctrl_protocol;
+static uint8_t ctrl_buf[FRAME_MAX_ENCODED * 4];
+static int ctrl_len, ctrl_pos;
+static int64_t ctrl_next, ctrl_next_press, ctrl_next_reset;
+static int ctrl_echoes;
+static uint32_t ctrl_rand;
+static int ctrl_strength[2];
+static uint8_t ctrl_samples[SIM_FRAME_SAMPLES * 2];
+static int ctrl_num_samples;
+/* What the controller has sent, for sim_received() to check against */
+static uint8_t ctrl_sent[SIM_SENT_LOG][2];
+static uint64_t ctrl_sent_count, ctrl_sent_pos;
+static sim_event_t ctrl_script[SIM_MAX_SCRIPT];
+static int ctrl_script_len, ctrl_script_pos;
+static int64_t ctrl_script_base;
+
+static uint32_t sim_random(uint32_t *state) {
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* Called from whichever of our functions main() reaches first */
+static void sim_read_options(void) {
+    static int done;
+    const char *env;
+    int i;
+    char *end;
+
+    if (done) return;
+    done = 1;
+
+    if ((env = getenv("GAME_SIM_GAMES"))) sim_options.games = atoi(env);
+    if ((env = getenv("GAME_SIM_SEED")) && atoi(env))
+	sim_options.seed = atoi(env);
+    sim_options.script = getenv("GAME_SIM_SCRIPT");
+    sim_options.framed = getenv("GAME_SIM_FRAMED") != NULL;
+    if ((env = getenv("GAME_SIM_RESET_S")))
+	sim_options.reset_us = strtod(env, NULL) * 1000000;
+    sim_options.lose_echo = getenv("GAME_SIM_LOSE_ECHO") != NULL;
+    sim_options.mash = getenv("GAME_SIM_MASH") != NULL;
+    sim_options.shuffle = getenv("GAME_SIM_SHUFFLE") != NULL;
+    if ((env = getenv("GAME_SIM_JITTER_US")))
+	sim_options.jitter_us = atoi(env);
+    if ((env = getenv("GAME_SIM_TICK_MS")) && atoi(env) > 0)
+	sim_options.tick_us = atoi(env) * 1000;
+    if ((env = getenv("GAME_SIM_STREAMS"))) {
+	for (i = 0; i < NUM_SIM_STREAMS && *env; i++) {
+	    sim_options.streams[i] = strtod(env, &end) * 1000000;
+	    env = *end ? end + 1 : end;
+	}
+    }
+    sim_options.quiet = getenv("GAME_SIM_QUIET") != NULL;
+
+    sim_sched_rand = sim_options.seed;
+}
+
+void sim_log(const char *fmt, ...) {
+    va_list ap;
+    char buf[256];
+    int len, i;
+
+    len = snprintf(buf, sizeof(buf), "%lld.%06lld ",
+		    (long long) (sim_now / 1000000),
+		    (long long) (sim_now % 1000000));
+    va_start(ap, fmt);
+    vsnprintf(buf + len, sizeof(buf) - len, fmt, ap);
+    va_end(ap);
+
+    for (i = 0; buf[i]; i++) {
+	sim_hash ^= (uint8_t) buf[i];
+	sim_hash *= 0x100000001b3ULL;
+    }
+    if (!sim_options.quiet) fputs(buf, stdout);
+}
+
+int64_t sim_clock_us(void) {
+    return sim_now;
+}
+
+static void sim_yield(void) {
+    assert(sim_current);
+    if (!_setjmp(sim_current->jmp)) _longjmp(sim_scheduler_jmp, 1);
+}
+
+void sim_sleep_us(int64_t us) {
+    if (sim_options.jitter_us)
+	us += sim_random(&sim_sched_rand) % sim_options.jitter_us;
+    sim_current->wake = sim_now + us;
+    sim_current->state = SIM_SLEEPING;
+    sim_yield();
+}
+
+/* With GAME_SIM_SHUFFLE another thread may run first, so that every order
+ * of lock sections gets tried. The default order would pick the same
+ * thread again, so don't pay for the switch. */
+void sim_lock(pthread_mutex_t *mutex) {
+    if (sim_options.shuffle) sim_yield();
+
+    /* Nothing else runs until we block again, so the lock must be free */
+    if (pthread_mutex_trylock(mutex)) {
+	sim_log("lock held across a switch\n");
+	abort();
+    }
+}
+
+void sim_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    sim_current->cond = cond;
+    sim_current->wait_order = sim_wait_count++;
+    sim_current->state = SIM_WAITING;
+    pthread_mutex_unlock(mutex);
+    sim_yield();
+
+    /* Nothing else runs until we block again, so the lock must be free */
+    if (pthread_mutex_trylock(mutex)) {
+	sim_log("lock held across a sleep\n");
+	abort();
+    }
+}
+
+void sim_wake(pthread_cond_t *cond, int all) {
+    int i;
+    sim_thread_t *first = NULL;
+
+    for (i = 0; i < sim_num_threads; i++) {
+	if (sim_threads[i].state != SIM_WAITING ||
+			sim_threads[i].cond != cond) continue;
+	if (all) sim_threads[i].state = SIM_RUNNABLE;
+	else if (!first || sim_threads[i].wait_order < first->wait_order)
+	    first = &sim_threads[i];
+    }
+    if (first) first->state = SIM_RUNNABLE;
+}
+
+static void sim_entry(void) {
+    sim_current->func(sim_current->arg);
+    sim_current->state = SIM_DONE;
+    _longjmp(sim_scheduler_jmp, 1);
+}
+
+void sim_thread_create(pthread_t *thread, void *(*func)(void *), void *arg) {
+    sim_thread_t *t;
+
+    assert(sim_num_threads < SIM_MAX_THREADS);
+    t = &sim_threads[sim_num_threads++];
+
+    getcontext(&t->context);
+    t->context.uc_stack.ss_sp = malloc(SIM_STACK_SIZE);
+    assert(t->context.uc_stack.ss_sp);
+    t->context.uc_stack.ss_size = SIM_STACK_SIZE;
+    t->context.uc_link = NULL;
+    makecontext(&t->context, sim_entry, 0);
+
+    t->func = func;
+    t->arg = arg;
+    t->state = SIM_RUNNABLE;
+    memset(thread, 0, sizeof(pthread_t));
+}
+
+static void sim_fail(const char *why) {
+    int i;
+    static const char *states[] = { "runnable", "sleeping", "waiting", "done" };
+
+    sim_log("%s after %d games\n", why, sim_games);
+    for (i = 0; i < sim_num_threads; i++)
+	sim_log("thread %d %s\n", i, states[sim_threads[i].state]);
+    fprintf(stderr, "sim: %s at %lld us, seed %u\n", why,
+		    (long long) sim_now, sim_options.seed);
+    exit(1);
+}
+
+/* Move the clock on to the next sleeper, returns 0 if there are none */
+static int sim_advance(void) {
+    int i;
+    int64_t next = -1;
+
+    for (i = 0; i < sim_num_threads; i++) {
+	if (sim_threads[i].state != SIM_SLEEPING) continue;
+	if (next < 0 || sim_threads[i].wake < next) next = sim_threads[i].wake;
+    }
+    if (next < 0) return 0;
+
+    sim_now = next;
+    for (i = 0; i < sim_num_threads; i++) {
+	if (sim_threads[i].state == SIM_SLEEPING &&
+			sim_threads[i].wake <= sim_now)
+	    sim_threads[i].state = SIM_RUNNABLE;
+    }
+    return 1;
+}
+
+static void sim_run(void) {
+    int i, n;
+    int runnable[SIM_MAX_THREADS];
+
+    while (!sim_finished) {
+	n = 0;
+	for (i = 0; i < sim_num_threads; i++)
+	    if (sim_threads[i].state == SIM_RUNNABLE) runnable[n++] = i;
+
+	if (!n) {
+	    if (!sim_advance()) sim_fail("deadlock");
+	    if (sim_now - sim_last_game > SIM_WATCHDOG_US)
+		sim_fail("stalled");
+	    continue;
+	}
+
+	/* Each thread runs until it blocks, so taking the first can't
+	 * starve anyone */
+	i = sim_options.shuffle ?
+		runnable[sim_random(&sim_sched_rand) % n] : runnable[0];
+	sim_current = &sim_threads[i];
+	sim_switches++;
+	if (!_setjmp(sim_scheduler_jmp)) {
+	    if (sim_current->started) _longjmp(sim_current->jmp, 1);
+	    sim_current->started = 1;
+	    swapcontext(&sim_scheduler, &sim_current->context);
+	}
+	sim_current = NULL;
+    }
+}
+
+/* Controller */
+static void ctrl_record(uint8_t instruction, uint8_t value) {
+    ctrl_sent[ctrl_sent_count % SIM_SENT_LOG][0] = instruction;
+    ctrl_sent[ctrl_sent_count % SIM_SENT_LOG][1] = value;
+    ctrl_sent_count++;
+}
+
+/* Called by the game for every packet it handles */
+void sim_received(uint8_t instruction, uint8_t value) {
+    uint64_t i;
+
+    if (ctrl_sent_count - ctrl_sent_pos > SIM_SENT_LOG)
+	ctrl_sent_pos = ctrl_sent_count - SIM_SENT_LOG;
+
+    for (i = ctrl_sent_pos; i < ctrl_sent_count; i++) {
+	if (ctrl_sent[i % SIM_SENT_LOG][0] == instruction &&
+			ctrl_sent[i % SIM_SENT_LOG][1] == value) {
+	    ctrl_sent_pos = i + 1;
+	    return;
+	}
+    }
+
+    sim_log("packet %02x %02x was never sent\n", instruction, value);
+    sim_fail("bad packet");
+}
+
+static void ctrl_send(uint8_t instruction, uint8_t value) {
+    /* Version 1 firmware can't send the header as a value */
+    if (protocol_mode(&ctrl_protocol) == PROTOCOL_LEGACY &&
+		    value == PACKET_HEADER) value--;
+    if (instruction != PROTOCOL_NEGOTIATE) ctrl_record(instruction, value);
+    ctrl_len += protocol_encode(&ctrl_protocol, instruction, value,
+		    ctrl_buf + ctrl_len);
+}
+
+static uint8_t ctrl_sample(int controller) {
+    /* Ranges which cover each controller's weighting curve, from a little
+     * below its offset, where weak players sit, up to the top of the
+     * sensor's range, where the strongest ones saturate it */
+    int low = controller ? 114 - 40 : 217 - 40;
+    int span = 255 - low;
+    int r = sim_random(&ctrl_rand) % 101;
+    int value = low + span * (80 * ctrl_strength[controller] + 30 * r) / 10000;
+
+    return value > 255 ? 255 : value;
+}
+
+static void ctrl_generate(void) {
+    int i;
+    uint8_t body[4 + SIM_FRAME_SAMPLES * 2];
+
+    if (sim_options.reset_us && sim_now >= ctrl_next_reset) {
+	if (ctrl_next_reset) {
+	    sim_log("controller reset\n");
+	    protocol_init(&ctrl_protocol);
+	    ctrl_num_samples = 0;
+	}
+	ctrl_next_reset = sim_now + sim_options.reset_us;
+    }
+
+    /* Players wait for the attract screen before pressing start */
+    if (!sim_options.mash && sim_stream != SIM_ATTRACT_STREAM)
+	ctrl_next_press = sim_now + SIM_PRESS_MIN_US +
+		sim_random(&ctrl_rand) % SIM_PRESS_RANGE_US;
+
+    if (sim_now >= ctrl_next_press) {
+	/* New players each time start is pressed */
+	ctrl_strength[0] = sim_random(&ctrl_rand) % 101;
+	ctrl_strength[1] = sim_random(&ctrl_rand) % 101;
+	ctrl_send(0x10, 1);
+	ctrl_send(0x10, 0);
+	ctrl_next_press = sim_now + SIM_PRESS_MIN_US +
+		sim_random(&ctrl_rand) % SIM_PRESS_RANGE_US;
+    }
+
+    if (protocol_mode(&ctrl_protocol) == PROTOCOL_LEGACY) {
+	ctrl_send(0x20, ctrl_sample(0));
+	ctrl_send(0x21, ctrl_sample(1));
+    } else {
+	ctrl_samples[ctrl_num_samples * 2] = ctrl_sample(0);
+	ctrl_samples[ctrl_num_samples * 2 + 1] = ctrl_sample(1);
+	if (++ctrl_num_samples == SIM_FRAME_SAMPLES) {
+	    body[0] = 0;
+	    body[1] = 2;
+	    body[2] = SIM_FRAME_SAMPLES;
+	    body[3] = sim_options.tick_us / 100;
+	    for (i = 0; i < SIM_FRAME_SAMPLES * 2; i++) {
+		body[4 + i] = ctrl_samples[i];
+		ctrl_record(0x20 | (i & 1), ctrl_samples[i]);
+	    }
+	    ctrl_len += protocol_encode_frame(&ctrl_protocol, FRAME_ANALOGUE,
+			    body, sizeof(body), ctrl_buf + ctrl_len);
+	    ctrl_num_samples = 0;
+	}
+    }
+
+    ctrl_next = sim_now + sim_options.tick_us;
+}
+
+static void ctrl_replay(void) {
+    sim_event_t *event;
+
+    while (ctrl_script_pos < ctrl_script_len &&
+		    ctrl_len + FRAME_MAX_ENCODED <= (int) sizeof(ctrl_buf)) {
+	event = &ctrl_script[ctrl_script_pos];
+	if (ctrl_script_base + event->time > sim_now) break;
+	ctrl_send(event->instruction, event->value);
+	ctrl_script_pos++;
+    }
+
+    if (ctrl_script_pos == ctrl_script_len) {
+	ctrl_script_base += ctrl_script[ctrl_script_len - 1].time +
+		sim_options.tick_us;
+	ctrl_script_pos = 0;
+    }
+    ctrl_next = ctrl_script_base + ctrl_script[ctrl_script_pos].time;
+}
+
+static int ctrl_load_script(const char *filename) {
+    FILE *fp;
+    long long ms;
+    unsigned int instruction, value;
+
+    if (!(fp = fopen(filename, "r"))) return -1;
+    while (ctrl_script_len < SIM_MAX_SCRIPT &&
+		    fscanf(fp, "%lld %x %u", &ms, &instruction, &value) == 3) {
+	ctrl_script[ctrl_script_len].time = ms * 1000;
+	ctrl_script[ctrl_script_len].instruction = instruction;
+	ctrl_script[ctrl_script_len].value = value;
+	ctrl_script_len++;
+    }
+    fclose(fp);
+
+    return ctrl_script_len ? 0 : -1;
+}
+
+int snd_rawmidi_open(snd_rawmidi_t **input, snd_rawmidi_t **output,
+		const char *name, int mode) {
+    sim_read_options();
+    protocol_init(&ctrl_protocol);
+    ctrl_rand = sim_options.seed;
+    ctrl_next_press = SIM_PRESS_MIN_US;
+
+    if (sim_options.script && ctrl_load_script(sim_options.script) < 0) {
+	fprintf(stderr, "sim: couldn't read %s\n", sim_options.script);
+	return -ENOENT;
+    }
+
+    *input = (snd_rawmidi_t *) &ctrl_protocol;
+    *output = (snd_rawmidi_t *) &ctrl_protocol;
+    return 0;
+}
+
+int snd_rawmidi_nonblock(snd_rawmidi_t *rawmidi, int nonblock) {
+    return 0;
+}
+
+int snd_rawmidi_poll_descriptors(snd_rawmidi_t *rawmidi, struct pollfd *pfds,
+		unsigned int space) {
+    return 0;
+}
+
+/* Blocks in virtual time until the controller has something to say */
+ssize_t snd_rawmidi_read(snd_rawmidi_t *rawmidi, void *buffer, size_t size) {
+    size_t len;
+
+    while (ctrl_pos == ctrl_len) {
+	ctrl_pos = ctrl_len = 0;
+	if (ctrl_next > sim_now) sim_sleep_us(ctrl_next - sim_now);
+	if (ctrl_script_len) ctrl_replay();
+	else ctrl_generate();
+    }
+
+    len = ctrl_len - ctrl_pos;
+    if (len > size) len = size;
+    memcpy(buffer, ctrl_buf + ctrl_pos, len);
+    ctrl_pos += len;
+
+    return len;
+}
+
+ssize_t snd_rawmidi_write(snd_rawmidi_t *rawmidi, const void *buffer,
+		size_t size) {
+    const uint8_t *data = (const uint8_t *) buffer;
+    char hex[3 * FRAME_MAX_ENCODED + 1];
+    size_t i;
+
+    for (i = 0; i < size && i < FRAME_MAX_ENCODED; i++)
+	sprintf(hex + 3 * i, " %02x", data[i]);
+    sim_log("uart tx%s\n", hex);
+
+    /* Acknowledge the offer of framing in version 1, even if we're
+     * already framing, then switch */
+    if (sim_options.framed && size == PACKET_SIZE &&
+		    data[0] == PACKET_HEADER && data[1] == PROTOCOL_NEGOTIATE &&
+		    data[2] == PROTOCOL_FRAMED) {
+	ctrl_protocol.mode = PROTOCOL_LEGACY;
+	if (sim_options.lose_echo && ctrl_echoes++ % 2 == 0)
+	    sim_log("echo lost\n");
+	else ctrl_send(PROTOCOL_NEGOTIATE, PROTOCOL_FRAMED);
+	ctrl_protocol.mode = PROTOCOL_FRAMED;
+	ctrl_num_samples = 0;
+    }
+
+    return size;
+}
+
+/* Dispmanx */
+static uint32_t sim_handles;
+
+DISPMANX_DISPLAY_HANDLE_T vc_dispmanx_display_open(uint32_t device) {
+    return ++sim_handles;
+}
+
+int vc_dispmanx_display_get_info(DISPMANX_DISPLAY_HANDLE_T display,
+		DISPMANX_MODEINFO_T *info) {
+    info->width = 1920;
+    info->height = 1080;
+    return 0;
+}
+
+int vc_dispmanx_display_close(DISPMANX_DISPLAY_HANDLE_T display) {
+    return 0;
+}
+
+DISPMANX_RESOURCE_HANDLE_T vc_dispmanx_resource_create(VC_IMAGE_TYPE_T type,
+		uint32_t width, uint32_t height, uint32_t *native_handle) {
+    return ++sim_handles;
+}
+
+int vc_dispmanx_resource_write_data(DISPMANX_RESOURCE_HANDLE_T res,
+		VC_IMAGE_TYPE_T src_type, int src_pitch, void *src_address,
+		const VC_RECT_T *rect) {
+    return 0;
+}
+
+int vc_dispmanx_resource_delete(DISPMANX_RESOURCE_HANDLE_T res) {
+    return 0;
+}
+
+int vc_dispmanx_rect_set(VC_RECT_T *rect, uint32_t x_offset,
+		uint32_t y_offset, uint32_t width, uint32_t height) {
+    rect->x = x_offset;
+    rect->y = y_offset;
+    rect->width = width;
+    rect->height = height;
+    return 0;
+}
+
+DISPMANX_UPDATE_HANDLE_T vc_dispmanx_update_start(int32_t priority) {
+    return ++sim_handles;
+}
+
+int vc_dispmanx_update_submit_sync(DISPMANX_UPDATE_HANDLE_T update) {
+    sim_sleep_us(SIM_VSYNC_US - sim_now % SIM_VSYNC_US);
+    return 0;
+}
+
+DISPMANX_ELEMENT_HANDLE_T vc_dispmanx_element_add(
+		DISPMANX_UPDATE_HANDLE_T update,
+		DISPMANX_DISPLAY_HANDLE_T display, int32_t layer,
+		const VC_RECT_T *dest_rect, DISPMANX_RESOURCE_HANDLE_T src,
+		const VC_RECT_T *src_rect, DISPMANX_PROTECTION_T protection,
+		VC_DISPMANX_ALPHA_T *alpha, void *clamp,
+		DISPMANX_TRANSFORM_T transform) {
+    return ++sim_handles;
+}
+
+int vc_dispmanx_element_remove(DISPMANX_UPDATE_HANDLE_T update,
+		DISPMANX_ELEMENT_HANDLE_T element) {
+    return 0;
+}
+
+int vc_dispmanx_element_change_layer(DISPMANX_UPDATE_HANDLE_T update,
+		DISPMANX_ELEMENT_HANDLE_T element, int32_t layer) {
+    return 0;
+}
+
+/* Sound effects are only recorded */
+int sfx_init(void) {
+    return 0;
+}
+
+void sfx_trigger(enum sfx_clip clip, int64_t time) {
+    static const char *names[NUM_SFX_CLIPS] = {
+	"start", "power_l", "power_r"
+    };
+
+    sim_log("sfx %s\n", names[clip]);
+}
+
+/* Player */
+bool OMXReader::SetActiveStream(OMXStreamType type, unsigned int index) {
+    if (type != OMXSTREAM_VIDEO) return true;
+
+    sim_log("stream %u\n", index);
+
+    /* A game is over once we leave the game stream, the winner may be
+     * skipped if start is pressed during the announcement */
+    if (sim_stream == SIM_GAME_STREAM) {
+	sim_last_game = sim_now;
+	if (++sim_games >= sim_options.games) sim_finished = 1;
+    }
+    if (index >= SIM_WINNER_STREAM) sim_wins[index - SIM_WINNER_STREAM]++;
+
+    sim_stream = index;
+    return true;
+}
+
+/* Plays the active stream, looping back to the start at the end */
+static void *player_func(void *p) {
+    int64_t position = 0;
+
+    while (1) {
+	sim_interface.set_media_time(position);
+	if (sim_control(&sim_reader)) position = 0;
+
+	sim_sleep_us(SIM_PLAYER_TICK_US);
+	position += SIM_PLAYER_TICK_US;
+
+	if (position >= sim_options.streams[sim_stream]) {
+	    sim_log("end of stream %u\n", sim_stream);
+	    if (sim_loop(&sim_reader)) position = 0;
+	}
+    }
+
+    return NULL;
+}
+
+OMXPlayerInterface *OMXPlayerInterface::get_interface() {
+    sim_read_options();
+    return &sim_interface;
+}
+
+/* Runs every thread until enough games have been played */
+int OMXPlayerInterface::omxplay_event_loop(int argc, char *argv[]) {
+    pthread_t player_thread;
+    struct timespec start, end;
+    double wall;
+
+    sim_control = callback_func;
+    sim_loop = loop_func;
+    sim_thread_create(&player_thread, player_func, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sim_run();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    fprintf(stderr, "sim: %d games in %.1fs virtual, %.3fs wall, "
+		    "%.0f games/s, %llu switches\n",
+		    sim_games, sim_now / 1e6, wall, sim_games / wall,
+		    (unsigned long long) sim_switches);
+    fprintf(stderr, "sim: winner videos %d/%d, %d skipped, seed %u, "
+		    "transcript %016llx\n",
+		    sim_wins[0], sim_wins[1],
+		    sim_games - sim_wins[0] - sim_wins[1], sim_options.seed,
+		    (unsigned long long) sim_hash);
+    return 0;
+}
@@ -0,0 +1,113 @@
+#ifndef SIM_H
+#define SIM_H
+
+/* Stand-ins for ALSA rawmidi, dispmanx and the player, so that game.cpp
+ * built with -DGAME_SIM runs the real game threads against a virtual clock
+ * on any Linux box. The threads are coroutines on one OS thread and only
+ * switch when they sleep or wait, so a run is deterministic for a given
+ * seed. See sim.cpp for the options. */
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int64_t sim_clock_us(void);
+void sim_sleep_us(int64_t us);
+void sim_lock(pthread_mutex_t *mutex);
+void sim_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+void sim_wake(pthread_cond_t *cond, int all);
+void sim_thread_create(pthread_t *thread, void *(*func)(void *), void *arg);
+void sim_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void sim_received(uint8_t instruction, uint8_t value);
+
+/* ALSA rawmidi, connected to a simulated controller */
+typedef struct sim_rawmidi snd_rawmidi_t;
+
+int snd_rawmidi_open(snd_rawmidi_t **input, snd_rawmidi_t **output,
+		const char *name, int mode);
+int snd_rawmidi_nonblock(snd_rawmidi_t *rawmidi, int nonblock);
+int snd_rawmidi_poll_descriptors(snd_rawmidi_t *rawmidi, struct pollfd *pfds,
+		unsigned int space);
+ssize_t snd_rawmidi_read(snd_rawmidi_t *rawmidi, void *buffer, size_t size);
+ssize_t snd_rawmidi_write(snd_rawmidi_t *rawmidi, const void *buffer,
+		size_t size);
+
+/* Dispmanx, where each submit waits for the next vsync */
+#define ALIGN_UP(x, y)	(((x) + (y) - 1) & ~((y) - 1))
+
+typedef uint32_t DISPMANX_DISPLAY_HANDLE_T;
+typedef uint32_t DISPMANX_UPDATE_HANDLE_T;
+typedef uint32_t DISPMANX_ELEMENT_HANDLE_T;
+typedef uint32_t DISPMANX_RESOURCE_HANDLE_T;
+typedef uint32_t DISPMANX_PROTECTION_T;
+
+typedef enum { VC_IMAGE_RGB565 = 1 } VC_IMAGE_TYPE_T;
+typedef enum { VC_IMAGE_ROT0 = 0 } VC_IMAGE_TRANSFORM_T;
+typedef enum { DISPMANX_NO_ROTATE = 0 } DISPMANX_TRANSFORM_T;
+
+typedef enum {
+    DISPMANX_FLAGS_ALPHA_FROM_SOURCE = 0,
+    DISPMANX_FLAGS_ALPHA_FIXED_ALL_PIXELS = 1
+} DISPMANX_FLAGS_ALPHA_T;
+
+#define DISPMANX_PROTECTION_NONE 0
+
+typedef struct {
+    int32_t x, y, width, height;
+} VC_RECT_T;
+
+typedef struct {
+    int32_t width, height;
+} DISPMANX_MODEINFO_T;
+
+typedef struct {
+    DISPMANX_FLAGS_ALPHA_T flags;
+    uint32_t opacity;
+    DISPMANX_RESOURCE_HANDLE_T mask;
+} VC_DISPMANX_ALPHA_T;
+
+DISPMANX_DISPLAY_HANDLE_T vc_dispmanx_display_open(uint32_t device);
+int vc_dispmanx_display_get_info(DISPMANX_DISPLAY_HANDLE_T display,
+		DISPMANX_MODEINFO_T *info);
+int vc_dispmanx_display_close(DISPMANX_DISPLAY_HANDLE_T display);
+DISPMANX_RESOURCE_HANDLE_T vc_dispmanx_resource_create(VC_IMAGE_TYPE_T type,
+		uint32_t width, uint32_t height, uint32_t *native_image_handle);
+int vc_dispmanx_resource_write_data(DISPMANX_RESOURCE_HANDLE_T res,
+		VC_IMAGE_TYPE_T src_type, int src_pitch, void *src_address,
+		const VC_RECT_T *rect);
+int vc_dispmanx_resource_delete(DISPMANX_RESOURCE_HANDLE_T res);
+int vc_dispmanx_rect_set(VC_RECT_T *rect, uint32_t x_offset,
+		uint32_t y_offset, uint32_t width, uint32_t height);
+DISPMANX_UPDATE_HANDLE_T vc_dispmanx_update_start(int32_t priority);
+int vc_dispmanx_update_submit_sync(DISPMANX_UPDATE_HANDLE_T update);
+DISPMANX_ELEMENT_HANDLE_T vc_dispmanx_element_add(
+		DISPMANX_UPDATE_HANDLE_T update,
+		DISPMANX_DISPLAY_HANDLE_T display, int32_t layer,
+		const VC_RECT_T *dest_rect, DISPMANX_RESOURCE_HANDLE_T src,
+		const VC_RECT_T *src_rect, DISPMANX_PROTECTION_T protection,
+		VC_DISPMANX_ALPHA_T *alpha, void *clamp,
+		DISPMANX_TRANSFORM_T transform);
+int vc_dispmanx_element_remove(DISPMANX_UPDATE_HANDLE_T update,
+		DISPMANX_ELEMENT_HANDLE_T element);
+int vc_dispmanx_element_change_layer(DISPMANX_UPDATE_HANDLE_T update,
+		DISPMANX_ELEMENT_HANDLE_T element, int32_t layer);
+
+/* The player's view of the media file */
+typedef enum OMXStreamType {
+    OMXSTREAM_NONE = 0, OMXSTREAM_AUDIO = 1, OMXSTREAM_VIDEO = 2,
+    OMXSTREAM_SUBTITLE = 3
+} OMXStreamType;
+
+class OMXReader {
+    public:
+	bool SetActiveStream(OMXStreamType type, unsigned int index);
+};
+
+#endif